@@ -53,12 +53,65 @@ class motion_segmentation : public cv::BackgroundSubtractor
     int _threshold;
 };
 
+/// \brief Helpers for segment-test detectors working on 16-bit masks of circle pixels
+/// (bit k is set when k-th pixel of the Bresenham circle passed the comparison)
+namespace circle_mask
+{
+/// \brief rotate 16-bit mask right by k positions, 0 < k < 16
+constexpr uint16_t rotate(uint16_t mask, int k)
+{
+    return static_cast<uint16_t>(((mask >> k) | (mask << (16 - k))) & 0xFFFF);
+}
+
+/// \brief bits starting a run of at least N (1 <= N <= 16) contiguous set bits on the circle
+constexpr uint16_t arcStarts(uint16_t mask, int N)
+{
+    int len = 1;
+    for (; 2 * len <= N; len *= 2)
+        mask &= rotate(mask, len);
+    if (len < N)
+        mask &= rotate(mask, N - len);
+    return mask;
+}
+
+/// \brief bits covered by runs of at least N contiguous set bits on the circle
+constexpr uint16_t arcCover(uint16_t mask, int N)
+{
+    const uint16_t starts = arcStarts(mask, N);
+    uint16_t cover = starts;
+    for (int k = 1; k < N; ++k)
+        cover |= rotate(starts, 16 - k);
+    return cover;
+}
+
+/// \brief check that circle contains at least N contiguous set bits
+constexpr bool hasArc(uint16_t mask, int N)
+{
+    return arcStarts(mask, N) != 0;
+}
+
+/// \brief number of set bits in mask
+constexpr int count(uint16_t mask)
+{
+    int n = 0;
+    for (; mask; mask &= mask - 1)
+        ++n;
+    return n;
+}
+} // namespace circle_mask
+
 /// \brief FAST corner detection algorithm
 class corner_detector_fast : public cv::Feature2D
 {
     public:
     /// \brief Fabrique method for creating FAST detector
-    static cv::Ptr<corner_detector_fast> create();
+    /// \param threshold, in - intensity difference between center and circle pixels
+    /// \param arc_length, in - number of contiguous circle pixels, 9..16
+    /// \param blur_size, in - size of Gaussian kernel applied before detection, 0 to disable
+    static cv::Ptr<corner_detector_fast> create(int threshold = 15, int arc_length = 11, int blur_size = 5);
+
+    /// \brief ctor
+    corner_detector_fast(int threshold = 15, int arc_length = 11, int blur_size = 5);
 
     /// \see Feature2d::detect
     virtual void detect(cv::InputArray _image, CV_OUT std::vector<cv::KeyPoint>& keypoints, cv::InputArray mask = cv::noArray()) override;
@@ -76,9 +129,237 @@ class corner_detector_fast : public cv::Feature2D
         return "FAST_Binary";
     }
 
-    bool checkPixel(cv::Mat& image, int i, int j, int N, int t);
-    bool checkMaxLenSeqPix(std::vector<int> seq, int N);
-    void generateNormPoints(int s, int len_desc);
+    /// \see Feature2d::descriptorSize
+    virtual int descriptorSize() const override
+    {
+        return 32;
+    }
+
+    /// \see Feature2d::descriptorType
+    virtual int descriptorType() const override
+    {
+        return CV_8U;
+    }
+
+    /// \see Feature2d::defaultNorm
+    virtual int defaultNorm() const override
+    {
+        return cv::NORM_HAMMING;
+    }
+
+    using cv::Feature2D::read;
+    using cv::Feature2D::write;
+
+    /// \see cv::Algorithm::write
+    virtual void write(cv::FileStorage& fs) const override;
+
+    /// \see cv::Algorithm::read
+    virtual void read(const cv::FileNode& fn) override;
+
+    void setThreshold(int threshold);
+    int getThreshold() const
+    {
+        return _threshold;
+    }
+
+    void setArcLength(int arc_length);
+    int getArcLength() const
+    {
+        return _arcLength;
+    }
+
+    void setBlurSize(int blur_size);
+    int getBlurSize() const
+    {
+        return _blurSize;
+    }
+
+    /// \brief Number of pyramid levels corners are detected on, 1 for single-scale detection
+    void setLevels(int levels);
+    int getLevels() const
+    {
+        return _nLevels;
+    }
+
+    /// \brief Ratio of sizes of neighbouring pyramid levels, greater than 1
+    void setScaleFactor(double scale_factor);
+    double getScaleFactor() const
+    {
+        return _scaleFactor;
+    }
+
+    /// \brief Enable or disable non-maximum suppression of corner scores
+    void setNonmaxSuppression(bool f)
+    {
+        _nonmaxSuppression = f;
+    }
+
+    bool getNonmaxSuppression() const
+    {
+        return _nonmaxSuppression;
+    }
+
+    /// \brief Enable steered BRIEF: keypoint angle is estimated by intensity centroid and pattern is rotated to it
+    void setOriented(bool oriented);
+    bool getOriented() const
+    {
+        return _oriented;
+    }
+
+    /// \brief Compare box sums of unblurred image at sampling points instead of pixels of blurred image
+    /// \note box sums come from integral image of keypoint patch and upper levels are resized from unblurred image,
+    ///       so the frame is never blurred and every octave is sampled on the same kind of image
+    void setBoxSampling(bool box_sampling);
+    bool getBoxSampling() const
+    {
+        return _boxSampling;
+    }
+
+    /// \brief Replace sampling pattern, e.g. by one stored with descriptor database
+    /// \param pattern, in - descriptorSize() * 16 points, two per descriptor bit, within _patchSize / 2 of keypoint
+    void setPattern(const std::vector<cv::Point2f>& pattern);
+    const std::vector<cv::Point2f>& getPattern() const
+    {
+        return _pairPixels;
+    }
+
+    /// \brief Generate sampling pattern from passed seed, default pattern corresponds to _defaultPatternSeed
+    void setPatternSeed(uint32_t seed);
+
+    /// \brief Keep only max_keypoints strongest corners, 0 means no limit
+    /// \param grid_rows, grid_cols, in - grid over image, every cell keeps an equal share of corners for even spatial spread
+    void setMaxKeypoints(int max_keypoints, int grid_rows = 1, int grid_cols = 1)
+    {
+        CV_Assert(max_keypoints >= 0 && grid_rows > 0 && grid_cols > 0);
+        _maxKeypoints = max_keypoints;
+        _gridRows = grid_rows;
+        _gridCols = grid_cols;
+    }
+
+    int getMaxKeypoints() const
+    {
+        return _maxKeypoints;
+    }
+
+    /// \brief Restrict detection to passed regions of interest, empty list means the whole image
+    void setRegions(const std::vector<cv::Rect>& regions)
+    {
+        _regions = regions;
+    }
+
+    const std::vector<cv::Rect>& getRegions() const
+    {
+        return _regions;
+    }
+
+    /// \brief Build grayscale and blurred images shared by detection and description
+    /// \param image, in - 8-bit BGR, BGRA or single-channel image, the latter is used without conversion
+    void prepareImage(cv::InputArray image);
+
+    /// \brief Blur prepared grayscale image, done once on first use
+    void ensureBlurred();
+
+    /// \brief Detect corners on image passed to prepareImage
+    void detectPrepared(std::vector<cv::KeyPoint>& keypoints, const cv::Mat& mask);
+
+    /// \brief Compute descriptors on image passed to prepareImage
+    void computePrepared(std::vector<cv::KeyPoint>& keypoints, cv::OutputArray descriptors);
+
+    /// \brief Scalar segment test of pixel (i, j), reference for the vectorized path
+    bool checkPixel(const cv::Mat& image, int i, int j, int N, int t);
+
+    /// \brief Segment test decision from 16-bit masks of brighter/darker circle pixels
+    bool checkArc(uint16_t bright, uint16_t dark, int N) const;
+
+    /// \brief Append len_desc pairs of normally distributed points within s x s neighbourhood to sampling pattern
+    /// \param seed, in - seed of platform-independent generator, equal seeds give equal patterns
+    void generateNormPoints(int s, int len_desc, uint32_t seed = _defaultPatternSeed);
+
+    /// \brief Image of pyramid level with data prepared for scanning
+    struct pyramid_level
+    {
+        cv::Mat image;
+        int octave = 0;
+        float scale = 1.f;
+        /// \brief linear offsets of _pixelsAround for the image step
+        int offsets[16] = {};
+        /// \brief spans of columns to scan, spans of row y are [rowSpans[y], rowSpans[y + 1]), no spans means full rows
+        std::vector<cv::Range> spans;
+        std::vector<int> rowSpans;
+        /// \brief linear offsets of sampling pattern for the image step, for every angle bin in oriented mode
+        std::vector<int> pairOffsets;
+        size_t pairOffsetsStep = 0;
+    };
+
+    /// \brief Corner score: sum of absolute differences minus threshold over the contiguous arc, 0 if pixel is not a corner
+    int cornerScore(const uchar* ptr, const int* offsets, uint16_t bright, uint16_t dark, int N, int t) const;
+
+    /// \brief Segment test over columns [col_begin, col_end) of row i of preprocessed image, vectorized where SIMD is available
+    /// \tparam ArcLength - compile-time arc length of specialized kernels, 0 to use N
+    /// \param scores, out - row of corner scores, only corners are written
+    /// \param corners, out - columns of detected corners in increasing order
+    template <int ArcLength>
+    void scanRow(const pyramid_level& level, int i, int col_begin, int col_end, int N, int t, int* scores, std::vector<int>& corners) const;
+
+    /// \brief Detect corners on rows [row_begin, row_end) of pyramid level with optional 3x3 non-maximum suppression
+    /// \note pixels within radius of the border are skipped, keypoints are returned in coordinates of the original image
+    void detectRows(const pyramid_level& level, int row_begin, int row_end, int N, int t, std::vector<cv::KeyPoint>& keypoints) const;
+
+    /// \brief Build per-row spans of pixels of pyramid level to scan from mask and regions of interest
+    /// \param mask, in - CV_8UC1 mask of original image size or empty one
+    void buildSpans(const cv::Mat& mask, pyramid_level& level) const;
+
+    /// \brief Build first levels of pyramid of prepared image, already built levels are kept
+    void buildPyramid(int levels);
+
+    /// \brief Build first levels of pyramid of unblurred image sampled in box mode, already built levels are kept
+    void buildBoxPyramid(int levels);
+
+    /// \brief Fill levels [built, levels) of pyramid of base image, every level is resized from the previous one
+    void resizeLevels(const cv::Mat& base, std::vector<pyramid_level>& pyramid, int built, int levels) const;
+
+    /// \brief Recompute linear offsets of sampling pattern when step of level image changes
+    void updatePairOffsets(pyramid_level& level) const;
+
+    /// \brief Build sampling pattern rotated to every angle bin and patch for orientation estimation
+    /// \param s, in - size of keypoint neighbourhood
+    void rotatePattern(int s);
+
+    /// \brief Position of keypoint on pyramid level of its octave
+    cv::Point samplingCenter(const cv::KeyPoint& kp, const pyramid_level& level) const;
+
+    /// \brief Keypoint orientation in degrees by intensity centroid of circular patch
+    /// \param center, in - pointer to keypoint position
+    /// \param step, in - row step of image around center
+    float orientation(const uchar* center, int step) const;
+
+    /// \brief Index of first offset of sampling pattern steered to passed angle, 0 if descriptor is not oriented
+    size_t patternStart(float angle) const;
+
+    /// \brief Compute descriptor of keypoint, steered by keypoint angle in oriented mode
+    /// \param center, in - pointer to keypoint position
+    /// \param offsets, in - offsets of sampling pattern for row step of image around center
+    /// \param desc, out - descriptorSize() bytes of descriptor
+    void describe(const uchar* center, const int* offsets, float angle, uint8_t* desc) const;
+
+    /// \brief Linear offsets of sampling pattern for passed row step, of all rotated patterns in oriented mode
+    void patternOffsets(int step, std::vector<int>& offsets) const;
+
+    /// \brief Recompute offsets of box sums of sampling pattern in integral image of patch
+    /// \param window, in - size of square keypoint patch
+    void updateBoxOffsets(int window);
+
+    /// \brief Copy window x window patch around center, pixels outside of image replicate the border
+    /// \param patch, out - window * window pixels
+    void extractPatch(const cv::Mat& image, cv::Point center, int window, uchar* patch) const;
+
+    /// \brief Compute descriptor of keypoint by box sums over its patch, steered by keypoint angle in oriented mode
+    /// \param sums, in - buffer of (window + 1) * (window + 1) values for integral image
+    /// \param desc, out - descriptorSize() bytes of descriptor
+    void describeBox(const uchar* patch, int window, int* sums, float angle, uint8_t* desc) const;
+
+    /// \brief Recompute linear offsets of _pixelsAround for passed row step
+    void updateOffsets(size_t step);
 
     std::vector<cv::Point> _pixelsAround = {
         cv::Point(0, -3), cv::Point(1, -3) , cv::Point(2, -2) , cv::Point(3, -1) ,
@@ -87,14 +368,77 @@ class corner_detector_fast : public cv::Feature2D
         cv::Point(-3, 0), cv::Point(-3, -1), cv::Point(-2, -2), cv::Point(-1, -3)
      };
 
-    std::vector<int>  _initialVerify = {1, 5, 9, 13};
-    std::vector<int>  _secondaryVerify = {2, 3, 4, 6, 7, 8, 10, 11, 12, 14, 15, 16};
+    static constexpr uint16_t _initialVerify = 0x1111; // pixels 1, 5, 9, 13
     int radius = 3;
-    std::vector<cv::Point2f> _pairPixels;
 
+    /// \brief size of keypoint neighbourhood sampled by descriptor
+    static constexpr int _patchSize = 25;
+    static constexpr uint32_t _defaultPatternSeed = 2463534242u;
+
+    static constexpr int _angleBins = 30;
+    bool _oriented = false;
+    /// \brief _pairPixels rotated to every angle bin, bin-major
+    std::vector<cv::Point> _rotatedPairs;
+    /// \brief largest coordinate of rotated patterns
+    int _orientedReach = 0;
+    /// \brief half-widths of rows of circular patch for orientation
+    std::vector<int> _umax;
+
+    static constexpr int _boxSize = 5;
+    bool _boxSampling = false;
+    /// \brief offsets of top-left corners of sampling boxes in integral image of patch, for every angle bin in oriented mode
+    std::vector<int> _boxOffsets;
+    int _boxWindow = 0;
+
+    /// \brief offsets of sampling pattern in patch copied for keypoints near the border
+    std::vector<int> _patchOffsets;
+    int _patchWindow = 0;
+
+    int _threshold;
+    int _arcLength;
+    int _blurSize;
+    int _nLevels = 1;
+    double _scaleFactor = 1.2;
+
+    int _offsets[16] = {};
+    size_t _offsetsStep = 0;
+
+    /// \brief buffers reused between frames, _gray and _blurred may refer to the input image or to each other
+    /// \note _blurred is empty until ensureBlurred is called
+    cv::Mat _grayBuffer;
+    cv::Mat _blurBuffer;
+    cv::Mat _gray;
+    cv::Mat _blurred;
+    std::vector<pyramid_level> _pyramid;
+    /// \brief number of levels built for the prepared image
+    int _pyramidLevels = 0;
+    /// \brief levels of unblurred image, box sums smooth the image themselves
+    std::vector<pyramid_level> _boxPyramid;
+    int _boxPyramidLevels = 0;
+
+    bool _nonmaxSuppression = true;
+
+    int _maxKeypoints = 0;
+    int _gridRows = 1;
+    int _gridCols = 1;
+
+    std::vector<cv::Rect> _regions;
+
+    /// \brief minimal number of rows in a band processed by one task of parallel detection
+    int _minBandRows = 16;
+
+    /// \brief minimal number of keypoints described by one task, smaller sets are described serially
+    int _minParallelKeypoints = 256;
+
+    private:
+    /// \brief Drop tables derived from sampling pattern after it changes
+    void invalidatePattern();
+
+    /// \brief sampling pattern, two points per descriptor bit, always filled since construction
+    std::vector<cv::Point2f> _pairPixels;
 };
 
-/// \brief Descriptor matched based on ratio of SSD
+/// \brief Descriptor matched based on ratio of distances to the nearest and the second nearest train descriptors
 class descriptor_matcher : public cv::DescriptorMatcher
 {
     public:
@@ -103,12 +447,41 @@ class descriptor_matcher : public cv::DescriptorMatcher
     {
     }
 
-    /// \brief setup ratio threshold for SSD filtering
+    /// \brief setup ratio threshold: query is matched only if its second nearest distance is greater than ratio times the nearest one
+    /// \note ratio of 1 or less disables the test
     void set_ratio(float r)
     {
         ratio_ = r;
     }
 
+    /// \brief Hamming distance between packed binary descriptors
+    /// \param bytes, in - length of descriptors in bytes
+    static int distance(const uint8_t* q_desc, const uint8_t* t_desc, int bytes);
+
+    /// \brief Hamming distance with early exit, comparison stops as soon as partial distance reaches bound
+    /// \return exact distance if it is less than bound, otherwise a value not less than bound
+    static int distance(const uint8_t* q_desc, const uint8_t* t_desc, int bytes, int bound);
+
+    /// \brief Enable approximate search by multi-index hashing over 16-bit substrings of descriptors, built by train()
+    /// \param probe_radius, in - Hamming radius of keys probed in every substring table, -1 for exact brute-force search
+    /// \note train descriptors closer than (probe_radius + 1) * substrings to query are always found,
+    ///       larger radius gives better recall of farther neighbours at cost of latency, masked matching is done by brute force
+    void set_index(int probe_radius);
+    int get_index() const
+    {
+        return probe_radius_;
+    }
+
+    /// \see cv::DescriptorMatcher::add
+    virtual void add(cv::InputArrayOfArrays descriptors) override;
+
+    /// \see cv::DescriptorMatcher::clear
+    virtual void clear() override;
+
+    /// \brief Concatenate descriptors of all train images into one buffer searched by matching
+    /// \note called by every matching method, does nothing if train collection did not change
+    virtual void train() override;
+
     protected:
     /// \see cv::DescriptorMatcher::knnMatchImpl
     virtual void knnMatchImpl(cv::InputArray queryDescriptors, std::vector<std::vector<cv::DMatch>>& matches, int k,
@@ -121,7 +494,7 @@ class descriptor_matcher : public cv::DescriptorMatcher
     /// \see cv::DescriptorMatcher::isMaskSupported
     virtual bool isMaskSupported() const override
     {
-        return false;
+        return true;
     }
 
     /// \see cv::DescriptorMatcher::isMaskSupported
@@ -134,10 +507,115 @@ class descriptor_matcher : public cv::DescriptorMatcher
         }
         return copy;
     }
-    int distance(const cv::Mat &q_desc, const cv::Mat &t_desc);
 
     private:
+    /// \brief Select train rows to search under per-image masks of query x train rows
+    /// \param search, out - train_ if every row is allowed for some query, otherwise copy of rows allowed for at least one query
+    /// \param rows, out - rows of train_ copied to search, empty if search is train_
+    /// \param pair_mask, out - mask of query x search rows, empty if every search row is allowed for every query
+    void applyMasks(cv::InputArrayOfArrays masks, int query_rows, cv::Mat& search, std::vector<int>& rows, cv::Mat& pair_mask) const;
+
+    /// \brief match of query with row of train buffer, the row is converted to image and its descriptor index
+    cv::DMatch toMatch(int query_idx, int row, int distance) const;
+
+    /// \brief Append up to k nearest rows to matches of query unless the ratio test rejects it
+    /// \param dist, idx, in - distances and search rows of at least two nearest rows sorted by distance, -1 for missing ones
+    /// \param rows, in - rows of train_ for search rows, nullptr if search is train_
+    void appendNearest(int query_idx, const int* dist, const int* idx, int k, const int* rows, std::vector<cv::DMatch>& query_matches) const;
+
+    /// \brief Build multi-index hashing tables of train_
+    void buildIndex();
+
+    /// \brief Sorted rows of train_ sharing a substring within probe radius with query
+    void indexCandidates(const uint8_t* q_desc, std::vector<int>& candidates) const;
+
+    /// \brief k nearest neighbours among index candidates
+    void knnIndex(const cv::Mat& q_desc, int k, std::vector<std::vector<cv::DMatch>>& matches) const;
+
+    /// \brief neighbours closer than bound among index candidates
+    void radiusIndex(const cv::Mat& q_desc, int bound, std::vector<std::vector<cv::DMatch>>& matches) const;
+
     float ratio_;
+
+    /// \brief descriptors of all train images, rows are padded to 64-bit words
+    cv::Mat train_;
+    int train_cols_ = 0;
+    /// \brief first row of every train image in train_
+    std::vector<int> start_idx_;
+    bool trained_ = false;
+
+    /// \brief hash table of substring, rows of train_ with key b are ids[offsets[b], offsets[b + 1])
+    struct hash_table
+    {
+        std::vector<int> offsets;
+        std::vector<int> ids;
+    };
+    std::vector<hash_table> index_;
+    int probe_radius_ = -1;
+};
+
+/// \brief Vocabulary tree of binary descriptors for image retrieval
+/// \note nodes are clustered by k-majority, images are scored by TF-IDF weighted bag of words through inverted file
+class vocabulary_tree
+{
+    public:
+    /// \brief ctor
+    /// \param branching, in - number of children of every node
+    /// \param levels, in - depth of tree, vocabulary has up to branching^levels words
+    vocabulary_tree(int branching = 10, int levels = 4);
+
+    /// \brief Build tree by hierarchical k-majority clustering, nodes of every level and members of a node are processed in parallel
+    /// \param images, in - CV_8U packed binary descriptors of training images, inverse document frequencies are taken from them
+    /// \param iterations, in - maximal number of k-majority iterations per node
+    void build(const std::vector<cv::Mat>& images, int iterations = 10);
+
+    /// \brief Number of words (leaves) of built tree
+    int words() const
+    {
+        return static_cast<int>(idf_.size());
+    }
+
+    /// \brief Word of descriptor, path from root follows the nearest child
+    int quantize(const uint8_t* desc) const;
+
+    /// \brief Add image to database
+    /// \return index of added image
+    int add(const cv::Mat& descriptors);
+
+    /// \brief Drop images of database, tree is kept
+    void clear();
+
+    /// \brief Images of database most similar to query
+    /// \param max_results, in - maximal number of returned images
+    /// \return pairs of image index and score in [0, 1] sorted by decreasing score
+    std::vector<std::pair<int, float>> query(const cv::Mat& descriptors, int max_results) const;
+
+    private:
+    /// \brief node of tree, children of node are stored contiguously
+    struct node
+    {
+        int first_child = -1;
+        int children = 0;
+        /// \brief word of leaf, -1 for inner nodes
+        int word = -1;
+    };
+
+    /// \brief L1-normalized TF-IDF vector of image, sorted by word
+    std::vector<std::pair<int, float>> bagOfWords(const cv::Mat& descriptors) const;
+
+    int branching_;
+    int levels_;
+    int bytes_ = 0;
+
+    /// \brief nodes in breadth-first order, root is the first one
+    std::vector<node> nodes_;
+    /// \brief centroid of every node, row per node
+    cv::Mat centers_;
+    std::vector<float> idf_;
+
+    /// \brief images containing word with weight of word in them
+    std::vector<std::vector<std::pair<int, float>>> inverted_;
+    int images_ = 0;
 };
 
 /// \brief Stitcher for merging images into big one
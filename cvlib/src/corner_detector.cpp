@@ -5,172 +5,1014 @@
  */
 
 #include "cvlib.hpp"
-#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 #include <ctime>
 
+#include <opencv2/core/hal/intrin.hpp>
+
+namespace
+{
+/// \brief fill 16-bit masks of circle pixels brighter than center + t and darker than center - t
+inline void pixelMasks(const uchar* ptr, const int* offsets, int t, uint16_t& bright, uint16_t& dark)
+{
+    const int hi = ptr[0] + t;
+    const int lo = ptr[0] - t;
+    bright = 0;
+    dark = 0;
+    for (int k = 0; k < 16; ++k)
+    {
+        const int p = ptr[offsets[k]];
+        bright |= static_cast<uint16_t>((p > hi) << k);
+        dark |= static_cast<uint16_t>((p < lo) << k);
+    }
+}
+
+/// \brief strict order of keypoints by response, ties are broken by position to keep selection deterministic
+inline bool stronger(const cv::KeyPoint& a, const cv::KeyPoint& b)
+{
+    if (a.response != b.response)
+        return a.response > b.response;
+    if (a.pt.y != b.pt.y)
+        return a.pt.y < b.pt.y;
+    return a.pt.x < b.pt.x;
+}
+
+/// \brief keep at most k strongest keypoints in every cell of grid laid over image, order of result is unspecified
+void retainBest(std::vector<cv::KeyPoint>& keypoints, int k, cv::Size grid, cv::Size size)
+{
+    const int cells = grid.area();
+    if (cells == 1 && keypoints.size() <= static_cast<size_t>(k))
+        return;
+
+    // bounded heaps with the weakest keypoint of a cell on top
+    std::vector<std::vector<cv::KeyPoint>> heaps(cells);
+    for (const auto& kp : keypoints)
+    {
+        const int cx = std::min(grid.width - 1, static_cast<int>(kp.pt.x) * grid.width / size.width);
+        const int cy = std::min(grid.height - 1, static_cast<int>(kp.pt.y) * grid.height / size.height);
+        auto& heap = heaps[cy * grid.width + cx];
+        if (heap.size() < static_cast<size_t>(k))
+        {
+            heap.push_back(kp);
+            std::push_heap(heap.begin(), heap.end(), stronger);
+        }
+        else if (stronger(kp, heap.front()))
+        {
+            std::pop_heap(heap.begin(), heap.end(), stronger);
+            heap.back() = kp;
+            std::push_heap(heap.begin(), heap.end(), stronger);
+        }
+    }
+
+    keypoints.clear();
+    for (const auto& heap : heaps)
+        keypoints.insert(keypoints.end(), heap.begin(), heap.end());
+}
+
+/// \brief xorshift32 generator of pattern coordinates, integer-only so pattern is the same on every platform and at compile time
+class pattern_rng
+{
+    public:
+    constexpr explicit pattern_rng(uint32_t seed) : state_(seed != 0 ? seed : 1u)
+    {
+    }
+
+    /// \brief normally distributed value with standard deviation sigma, values outside of [-range, range] are redrawn
+    constexpr int next(int sigma, int range)
+    {
+        int value = 0;
+        do
+        {
+            // Irwin-Hall: sum of 12 uniform values minus their mean is close to standard normal, 12-bit fixed point
+            int sum = 0;
+            for (int i = 0; i < 12; ++i)
+            {
+                state_ ^= state_ << 13;
+                state_ ^= state_ >> 17;
+                state_ ^= state_ << 5;
+                sum += static_cast<int>(state_ >> 20);
+            }
+            // rounded to nearest, truncation would give 0 twice the mass of its neighbours
+            const int scaled = (sum - 6 * 4096) * sigma;
+            value = (scaled + (scaled < 0 ? -2048 : 2048)) / 4096;
+        } while (value < -range || value > range);
+        return value;
+    }
+
+    /// \brief x1, y1, x2, y2 of pair of distinct points, pair of equal points would give constant bit
+    constexpr void nextPair(int sigma, int range, int* coords)
+    {
+        do
+        {
+            for (int c = 0; c < 4; ++c)
+                coords[c] = next(sigma, range);
+        } while (coords[0] == coords[2] && coords[1] == coords[3]);
+    }
+
+    private:
+    uint32_t state_;
+};
+
+/// \brief default sampling pattern, x1, y1, x2, y2 of every pair
+struct pattern_table
+{
+    int8_t coords[4 * 256];
+};
+
+/// \brief points of s x s neighbourhood distributed as in BRIEF: isotropic Gaussian with variance s^2 / 25
+constexpr pattern_table makePattern(uint32_t seed, int s)
+{
+    pattern_table table{};
+    pattern_rng rng(seed);
+    for (int i = 0; i < 256; ++i)
+    {
+        int coords[4] = {};
+        rng.nextPair(s / 5, s / 2, coords);
+        for (int c = 0; c < 4; ++c)
+            table.coords[4 * i + c] = static_cast<int8_t>(coords[c]);
+    }
+    return table;
+}
+
+// generated by compiler, descriptors do not depend on standard library and process startup does no generation
+constexpr pattern_table defaultPattern = makePattern(cvlib::corner_detector_fast::_defaultPatternSeed, cvlib::corner_detector_fast::_patchSize);
+} // namespace
+
 namespace cvlib
 {
 // static
-cv::Ptr<corner_detector_fast> corner_detector_fast::create()
+cv::Ptr<corner_detector_fast> corner_detector_fast::create(int threshold, int arc_length, int blur_size)
+{
+    return cv::makePtr<corner_detector_fast>(threshold, arc_length, blur_size);
+}
+
+corner_detector_fast::corner_detector_fast(int threshold, int arc_length, int blur_size)
+{
+    setThreshold(threshold);
+    setArcLength(arc_length);
+    setBlurSize(blur_size);
+
+    _pairPixels.resize(2 * 256);
+    for (size_t k = 0; k < _pairPixels.size(); ++k)
+        _pairPixels[k] = cv::Point2f(defaultPattern.coords[2 * k], defaultPattern.coords[2 * k + 1]);
+}
+
+void corner_detector_fast::setThreshold(int threshold)
+{
+    CV_Assert(threshold >= 0 && threshold <= 255);
+    _threshold = threshold;
+}
+
+void corner_detector_fast::setArcLength(int arc_length)
+{
+    CV_Assert(arc_length >= 9 && arc_length <= 16);
+    _arcLength = arc_length;
+}
+
+void corner_detector_fast::setBlurSize(int blur_size)
+{
+    CV_Assert(blur_size == 0 || (blur_size > 0 && blur_size % 2 == 1));
+    _blurSize = blur_size;
+}
+
+void corner_detector_fast::setLevels(int levels)
+{
+    CV_Assert(levels >= 1);
+    _nLevels = levels;
+}
+
+void corner_detector_fast::setScaleFactor(double scale_factor)
+{
+    CV_Assert(scale_factor > 1.0);
+    _scaleFactor = scale_factor;
+    _pyramidLevels = std::min(_pyramidLevels, 1);
+    _boxPyramidLevels = std::min(_boxPyramidLevels, 1);
+}
+
+void corner_detector_fast::setOriented(bool oriented)
+{
+    _oriented = oriented;
+    invalidatePattern();
+}
+
+void corner_detector_fast::setBoxSampling(bool box_sampling)
+{
+    _boxSampling = box_sampling;
+    _boxWindow = 0;
+}
+
+void corner_detector_fast::write(cv::FileStorage& fs) const
+{
+    writeFormat(fs);
+    fs << "threshold" << _threshold;
+    fs << "arc_length" << _arcLength;
+    fs << "blur_size" << _blurSize;
+    fs << "levels" << _nLevels;
+    fs << "scale_factor" << _scaleFactor;
+    fs << "nonmax_suppression" << static_cast<int>(_nonmaxSuppression);
+    fs << "oriented" << static_cast<int>(_oriented);
+    fs << "box_sampling" << static_cast<int>(_boxSampling);
+    fs << "max_keypoints" << _maxKeypoints;
+    fs << "grid_rows" << _gridRows;
+    fs << "grid_cols" << _gridCols;
+    fs << "pattern" << _pairPixels;
+}
+
+void corner_detector_fast::read(const cv::FileNode& fn)
+{
+    // absent fields keep current values
+    if (!fn["threshold"].empty())
+        setThreshold(static_cast<int>(fn["threshold"]));
+    if (!fn["arc_length"].empty())
+        setArcLength(static_cast<int>(fn["arc_length"]));
+    if (!fn["blur_size"].empty())
+        setBlurSize(static_cast<int>(fn["blur_size"]));
+    if (!fn["levels"].empty())
+        setLevels(static_cast<int>(fn["levels"]));
+    if (!fn["scale_factor"].empty())
+        setScaleFactor(static_cast<double>(fn["scale_factor"]));
+    if (!fn["nonmax_suppression"].empty())
+        setNonmaxSuppression(static_cast<int>(fn["nonmax_suppression"]) != 0);
+    if (!fn["oriented"].empty())
+        setOriented(static_cast<int>(fn["oriented"]) != 0);
+    if (!fn["box_sampling"].empty())
+        setBoxSampling(static_cast<int>(fn["box_sampling"]) != 0);
+    if (!fn["max_keypoints"].empty())
+    {
+        const int grid_rows = fn["grid_rows"].empty() ? _gridRows : static_cast<int>(fn["grid_rows"]);
+        const int grid_cols = fn["grid_cols"].empty() ? _gridCols : static_cast<int>(fn["grid_cols"]);
+        setMaxKeypoints(static_cast<int>(fn["max_keypoints"]), grid_rows, grid_cols);
+    }
+    if (!fn["pattern"].empty())
+    {
+        std::vector<cv::Point2f> pattern;
+        fn["pattern"] >> pattern;
+        setPattern(pattern);
+    }
+}
+
+void corner_detector_fast::setPattern(const std::vector<cv::Point2f>& pattern)
+{
+    CV_Assert(pattern.size() == static_cast<size_t>(descriptorSize()) * 16);
+    for (const auto& p : pattern)
+        CV_Assert(std::abs(cvRound(p.x)) <= _patchSize / 2 && std::abs(cvRound(p.y)) <= _patchSize / 2);
+    _pairPixels = pattern;
+    invalidatePattern();
+}
+
+void corner_detector_fast::setPatternSeed(uint32_t seed)
+{
+    _pairPixels.clear();
+    generateNormPoints(_patchSize, descriptorSize() * 8, seed);
+}
+
+void corner_detector_fast::invalidatePattern()
 {
-    return cv::makePtr<corner_detector_fast>();
+    // derived tables are rebuilt for the new pattern
+    _rotatedPairs.clear();
+    _boxWindow = 0;
+    _patchWindow = 0;
+    for (auto& level : _pyramid)
+        level.pairOffsetsStep = 0;
+}
+
+constexpr uint16_t corner_detector_fast::_initialVerify;
+constexpr int corner_detector_fast::_angleBins;
+constexpr int corner_detector_fast::_boxSize;
+constexpr int corner_detector_fast::_patchSize;
+constexpr uint32_t corner_detector_fast::_defaultPatternSeed;
+
+bool corner_detector_fast::checkPixel(const cv::Mat& image, int i, int j, int N, int t)
+{
+    updateOffsets(image.step);
+    uint16_t bright, dark;
+    pixelMasks(image.ptr<uchar>(i, j), _offsets, t, bright, dark);
+    return checkArc(bright, dark, N);
+}
+
+bool corner_detector_fast::checkArc(uint16_t bright, uint16_t dark, int N) const
+{
+    // any arc of N pixels contains at least N / 4 of pixels 1, 5, 9, 13
+    const int pretest = N / 4;
+    return (circle_mask::count(bright & _initialVerify) >= pretest && circle_mask::hasArc(bright, N)) ||
+           (circle_mask::count(dark & _initialVerify) >= pretest && circle_mask::hasArc(dark, N));
+}
+
+void corner_detector_fast::generateNormPoints(int s, int len_desc, uint32_t seed)
+{
+    // same distribution as the compile-time default pattern, every point is inside the neighbourhood
+    int range_mask = s / 2;
+    int sigma = s / 5;
+    pattern_rng generator(seed);
+    int coords[4];
+
+    for (int i = 0; i < len_desc; i++)
+    {
+        generator.nextPair(sigma, range_mask, coords);
+        _pairPixels.push_back(cv::Point(coords[0], coords[1]));
+        _pairPixels.push_back(cv::Point(coords[2], coords[3]));
+    }
+
+    invalidatePattern();
+}
+
+void corner_detector_fast::rotatePattern(int s)
+{
+    const int n = static_cast<int>(_pairPixels.size());
+    _rotatedPairs.resize(_angleBins * n);
+    _orientedReach = s / 2;
+    for (int bin = 0; bin < _angleBins; ++bin)
+    {
+        const double angle = bin * 2 * CV_PI / _angleBins;
+        const double c = std::cos(angle);
+        const double sn = std::sin(angle);
+        for (int k = 0; k < n; ++k)
+        {
+            const cv::Point2f& p = _pairPixels[k];
+            const cv::Point r(cvRound(p.x * c - p.y * sn), cvRound(p.x * sn + p.y * c));
+            _rotatedPairs[bin * n + k] = r;
+            _orientedReach = std::max(_orientedReach, std::max(std::abs(r.x), std::abs(r.y)));
+        }
+    }
+
+    // half-widths of rows of the circular patch for intensity centroid
+    const int r = s / 2;
+    _umax.resize(r + 1);
+    for (int v = 0; v <= r; ++v)
+        _umax[v] = cvFloor(std::sqrt(double(r * r - v * v)));
+}
+
+void corner_detector_fast::updateOffsets(size_t step)
+{
+    if (step == _offsetsStep)
+        return;
+
+    for (size_t k = 0; k < _pixelsAround.size(); ++k)
+        _offsets[k] = _pixelsAround[k].y * static_cast<int>(step) + _pixelsAround[k].x;
+    _offsetsStep = step;
+}
+
+int corner_detector_fast::cornerScore(const uchar* ptr, const int* offsets, uint16_t bright, uint16_t dark, int N, int t) const
+{
+    if (!checkArc(bright, dark, N))
+        return 0;
+
+    // sum of absolute differences over pixels of the contiguous arcs, the brighter or darker one
+    int score = 0;
+    for (int polarity = 0; polarity < 2; ++polarity)
+    {
+        const uint16_t arc = circle_mask::arcCover(polarity ? dark : bright, N);
+        int sum = 0;
+        for (int k = 0; k < 16; ++k)
+        {
+            if (arc & (1 << k))
+                sum += std::abs(ptr[offsets[k]] - ptr[0]) - t;
+        }
+        score = std::max(score, sum);
+    }
+    return score;
+}
+
+template <int ArcLength>
+void corner_detector_fast::scanRow(const pyramid_level& level, int i, int col_begin, int col_end, int N, int t, int* scores,
+                                   std::vector<int>& corners) const
+{
+    // arc length is a constant in specialized kernels, so mask checks are unrolled by compiler
+    if (ArcLength)
+        N = ArcLength;
+    const uchar* row = level.image.ptr<uchar>(i);
+    const int* offsets = level.offsets;
+    int j = col_begin;
+#if CV_SIMD
+    const int lanes = cv::v_uint8::nlanes;
+    const cv::v_uint8 v_t = cv::vx_setall_u8(static_cast<uchar>(t));
+    const cv::v_uint8 v_one = cv::vx_setall_u8(1);
+    const cv::v_uint8 v_pretest = cv::vx_setall_u8(static_cast<uchar>(N / 4 - 1));
+    uchar bright_lo[cv::v_uint8::nlanes], bright_hi[cv::v_uint8::nlanes];
+    uchar dark_lo[cv::v_uint8::nlanes], dark_hi[cv::v_uint8::nlanes];
+
+    for (; j <= col_end - lanes; j += lanes)
+    {
+        const uchar* ptr = row + j;
+        const cv::v_uint8 center = cv::vx_load(ptr);
+        const cv::v_uint8 hi = center + v_t; // saturated
+        const cv::v_uint8 lo = center - v_t;
+
+        // quick rejection of the whole chunk by pixels 1, 5, 9, 13
+        cv::v_uint8 bright_count = cv::vx_setzero_u8();
+        cv::v_uint8 dark_count = cv::vx_setzero_u8();
+        for (int k = 0; k < 16; k += 4)
+        {
+            const cv::v_uint8 p = cv::vx_load(ptr + offsets[k]);
+            bright_count = bright_count + ((p > hi) & v_one);
+            dark_count = dark_count + ((lo > p) & v_one);
+        }
+        if (!cv::v_check_any((bright_count > v_pretest) | (dark_count > v_pretest)))
+            continue;
+
+        // transpose comparison results into per-lane 16-bit masks
+        cv::v_uint8 v_bright_lo = cv::vx_setzero_u8(), v_bright_hi = cv::vx_setzero_u8();
+        cv::v_uint8 v_dark_lo = cv::vx_setzero_u8(), v_dark_hi = cv::vx_setzero_u8();
+        for (int k = 0; k < 8; ++k)
+        {
+            const cv::v_uint8 bit = cv::vx_setall_u8(static_cast<uchar>(1 << k));
+            const cv::v_uint8 p_lo = cv::vx_load(ptr + offsets[k]);
+            const cv::v_uint8 p_hi = cv::vx_load(ptr + offsets[k + 8]);
+            v_bright_lo = v_bright_lo | ((p_lo > hi) & bit);
+            v_dark_lo = v_dark_lo | ((lo > p_lo) & bit);
+            v_bright_hi = v_bright_hi | ((p_hi > hi) & bit);
+            v_dark_hi = v_dark_hi | ((lo > p_hi) & bit);
+        }
+        cv::v_store(bright_lo, v_bright_lo);
+        cv::v_store(bright_hi, v_bright_hi);
+        cv::v_store(dark_lo, v_dark_lo);
+        cv::v_store(dark_hi, v_dark_hi);
+
+        for (int l = 0; l < lanes; ++l)
+        {
+            const uint16_t bright = static_cast<uint16_t>(bright_lo[l] | (bright_hi[l] << 8));
+            const uint16_t dark = static_cast<uint16_t>(dark_lo[l] | (dark_hi[l] << 8));
+            const int score = cornerScore(ptr + l, offsets, bright, dark, N, t);
+            if (score > 0)
+            {
+                scores[j + l] = score;
+                corners.push_back(j + l);
+            }
+        }
+    }
+#endif
+    for (; j < col_end; j++)
+    {
+        uint16_t bright, dark;
+        pixelMasks(row + j, offsets, t, bright, dark);
+        const int score = cornerScore(row + j, offsets, bright, dark, N, t);
+        if (score > 0)
+        {
+            scores[j] = score;
+            corners.push_back(j);
+        }
+    }
 }
 
-bool corner_detector_fast::checkPixel(cv::Mat &image, int i, int j, int N, int t)
+void corner_detector_fast::detectRows(const pyramid_level& level, int row_begin, int row_end, int N, int t,
+                                      std::vector<cv::KeyPoint>& keypoints) const
 {
-    std::vector<int> _successVerify = std::vector<int>(16, -255);
-    int count_black = 0;
-    int count_white = 0;
+    const cv::Mat& image = level.image;
+    const float size = float(radius + 3) * level.scale;
+
+    // suppression needs scores of one row above and below the band
+    const int first = _nonmaxSuppression ? std::max(radius, row_begin - 1) : row_begin;
+    const int last = _nonmaxSuppression ? std::min(image.rows - radius, row_end + 1) : row_end;
 
-    for (auto firstIndex : _initialVerify)
+    // ring of three score rows, row i is kept in slot i % 3
+    cv::AutoBuffer<int> buffer(3 * image.cols);
+    std::fill(buffer.data(), buffer.data() + 3 * image.cols, 0);
+    int* scores[3] = {buffer.data(), buffer.data() + image.cols, buffer.data() + 2 * image.cols};
+    std::vector<int> corners[3];
+
+    // strongest corners of every grid cell are selected while the band is scanned, so the band holds
+    // at most twice the quota of all cells however busy the frame is
+    const cv::Size frame = _blurred.size();
+    const cv::Size grid(_gridCols, _gridRows);
+    const int cellQuota = (_maxKeypoints + grid.area() - 1) / grid.area();
+    const size_t trimSize = 2 * static_cast<size_t>(cellQuota) * grid.area();
+
+    using scan_fn = void (corner_detector_fast::*)(const pyramid_level&, int, int, int, int, int, int*, std::vector<int>&) const;
+    const scan_fn scan = N == 9 ? &corner_detector_fast::scanRow<9> : N == 12 ? &corner_detector_fast::scanRow<12> : &corner_detector_fast::scanRow<0>;
+
+    for (int i = first; i <= last; ++i)
     {
-        if (image.at<uchar>(cv::Point(j, i) + _pixelsAround[firstIndex - 1]) > image.at<uchar>(i, j) + t)
+        if (_maxKeypoints > 0 && keypoints.size() >= trimSize)
+            retainBest(keypoints, cellQuota, grid, frame);
+
+        int* cur = scores[i % 3];
+        std::fill(cur, cur + image.cols, 0);
+        corners[i % 3].clear();
+        if (i < last && level.rowSpans.empty())
         {
-            count_white++;
-            _successVerify[firstIndex - 1] = 255;
+            (this->*scan)(level, i, radius, image.cols - radius, N, t, cur, corners[i % 3]);
         }
-        else if (image.at<uchar>(cv::Point(j, i) + _pixelsAround[firstIndex - 1]) < image.at<uchar>(i, j) - t)
+        else if (i < last)
+        {
+            // spans are sorted and disjoint, so corners stay in increasing column order
+            for (int k = level.rowSpans[i]; k < level.rowSpans[i + 1]; ++k)
+            {
+                const int begin = std::max(level.spans[k].start, radius);
+                const int end = std::min(level.spans[k].end, image.cols - radius);
+                if (begin < end)
+                    (this->*scan)(level, i, begin, end, N, t, cur, corners[i % 3]);
+            }
+        }
+
+        if (!_nonmaxSuppression)
+        {
+            for (int j : corners[i % 3])
+                keypoints.emplace_back(cv::Point2f(j * level.scale, i * level.scale), size, -1.f, float(cur[j]), level.octave);
+            continue;
+        }
+
+        // all neighbours of row i - 1 are known now
+        const int r = i - 1;
+        if (r < row_begin || r >= row_end)
+            continue;
+
+        const int* prev = scores[(r - 1) % 3];
+        const int* curr = scores[r % 3];
+        const int* next = scores[i % 3];
+        for (int j : corners[r % 3])
         {
-            count_black++;
-            _successVerify[firstIndex - 1] = 0;
+            const int score = curr[j];
+            if (score > curr[j - 1] && score > curr[j + 1] && score > prev[j - 1] && score > prev[j] && score > prev[j + 1] &&
+                score > next[j - 1] && score > next[j] && score > next[j + 1])
+            {
+                keypoints.emplace_back(cv::Point2f(j * level.scale, r * level.scale), size, -1.f, float(score), level.octave);
+            }
         }
     }
+}
+
+void corner_detector_fast::buildSpans(const cv::Mat& full_mask, pyramid_level& level) const
+{
+    level.spans.clear();
+    level.rowSpans.clear();
+    if (full_mask.empty() && _regions.empty())
+        return;
 
-    if ((count_black >= radius) || (count_white >= radius))
+    const cv::Size size = level.image.size();
+    cv::Mat mask = full_mask;
+    if (!mask.empty() && mask.size() != size)
+        cv::resize(full_mask, mask, size, 0, 0, cv::INTER_NEAREST);
+
+    level.rowSpans.assign(size.height + 1, 0);
+    std::vector<cv::Range> ranges;
+    for (int y = 0; y < size.height; ++y)
     {
-        for (auto secondIndex : _secondaryVerify)
+        // union of regions crossing the row
+        ranges.clear();
+        for (const auto& roi : _regions)
+        {
+            const int begin = std::max(cvFloor(roi.x / level.scale), 0);
+            const int end = std::min(cvCeil((roi.x + roi.width) / level.scale), size.width);
+            if (y >= cvFloor(roi.y / level.scale) && y < cvCeil((roi.y + roi.height) / level.scale) && begin < end)
+                ranges.emplace_back(begin, end);
+        }
+        if (_regions.empty())
+            ranges.emplace_back(0, size.width);
+
+        std::sort(ranges.begin(), ranges.end(), [](const cv::Range& a, const cv::Range& b) { return a.start < b.start; });
+        size_t merged = 0;
+        for (size_t k = 1; k < ranges.size(); ++k)
         {
-            if (image.at<uchar>(cv::Point(j, i) + _pixelsAround[secondIndex - 1]) > image.at<uchar>(i, j) + t)
+            if (ranges[k].start <= ranges[merged].end)
+                ranges[merged].end = std::max(ranges[merged].end, ranges[k].end);
+            else
+                ranges[++merged] = ranges[k];
+        }
+        ranges.resize(std::min(ranges.size(), merged + 1));
+
+        // run-length encoding of the mask inside of every range
+        for (const auto& range : ranges)
+        {
+            if (mask.empty())
             {
-                _successVerify[secondIndex - 1] = 255;
+                level.spans.push_back(range);
+                continue;
             }
-            else if (image.at<uchar>(cv::Point(j, i) + _pixelsAround[secondIndex - 1]) < image.at<uchar>(i, j) - t)
+
+            const uchar* m = mask.ptr<uchar>(y);
+            for (int x = range.start; x < range.end;)
             {
-                _successVerify[secondIndex - 1] = 0;
+                while (x < range.end && !m[x])
+                    ++x;
+                const int begin = x;
+                while (x < range.end && m[x])
+                    ++x;
+                if (begin < x)
+                    level.spans.emplace_back(begin, x);
             }
         }
+        level.rowSpans[y + 1] = static_cast<int>(level.spans.size());
+    }
+}
 
-        if (checkMaxLenSeqPix(_successVerify, N))
-            return true;
+void corner_detector_fast::buildPyramid(int levels)
+{
+    ensureBlurred();
+    resizeLevels(_blurred, _pyramid, _pyramidLevels, levels);
+    for (int l = _pyramidLevels; l < levels; ++l)
+    {
+        const int step = static_cast<int>(_pyramid[l].image.step);
+        for (size_t k = 0; k < _pixelsAround.size(); ++k)
+            _pyramid[l].offsets[k] = _pixelsAround[k].y * step + _pixelsAround[k].x;
     }
+    _pyramidLevels = std::max(_pyramidLevels, levels);
+}
 
-        return false;
+void corner_detector_fast::buildBoxPyramid(int levels)
+{
+    resizeLevels(_gray, _boxPyramid, _boxPyramidLevels, levels);
+    _boxPyramidLevels = std::max(_boxPyramidLevels, levels);
 }
 
-bool corner_detector_fast::checkMaxLenSeqPix(std::vector<int> seq, int N)
+void corner_detector_fast::resizeLevels(const cv::Mat& base, std::vector<pyramid_level>& pyramid, int built, int levels) const
 {
-    int countMax = 1;
-    int count = 1;
-    size_t size = seq.size();
+    if (static_cast<int>(pyramid.size()) < levels)
+        pyramid.resize(levels);
 
-    for (size_t k = 1; k < 2*size - 2; k++)
+    // level buffers are kept between frames, resize reallocates them only when frame size changes
+    for (int l = built; l < levels; ++l)
     {
-        if (seq[k%size] == seq[(k - 1)%size])
-            count++;
+        pyramid_level& level = pyramid[l];
+        level.octave = l;
+        level.scale = static_cast<float>(std::pow(_scaleFactor, l));
+        if (l == 0)
+        {
+            level.image = base;
+        }
         else
-            count = 1;
+        {
+            const cv::Size size(cvRound(base.cols / level.scale), cvRound(base.rows / level.scale));
+            cv::resize(pyramid[l - 1].image, level.image, size, 0, 0, cv::INTER_LINEAR);
+        }
+    }
+}
 
-        if (count > countMax)
-            countMax = count;
+void corner_detector_fast::prepareImage(cv::InputArray _image)
+{
+    _pyramidLevels = 0;
+    _boxPyramidLevels = 0;
+    const cv::Mat image = _image.getMat();
+    if (image.empty())
+    {
+        _gray.release();
+        _blurred.release();
+        return;
     }
+    CV_Assert(image.depth() == CV_8U && (image.channels() == 1 || image.channels() == 3 || image.channels() == 4));
 
-    if (countMax >= N)
-        return true;
+    if (image.channels() == 1)
+    {
+        _gray = image;
+    }
     else
-        return false;
+    {
+        cv::cvtColor(image, _grayBuffer, image.channels() == 3 ? cv::COLOR_BGR2GRAY : cv::COLOR_BGRA2GRAY);
+        _gray = _grayBuffer;
+    }
+
+    // blurring is postponed until detection or sampling of blurred image needs it
+    _blurred.release();
 }
 
-void corner_detector_fast::generateNormPoints(int s, int len_desc)
+void corner_detector_fast::ensureBlurred()
 {
-    int range_mask = s / 2;
-    std::default_random_engine generator;
-    std::normal_distribution<double> distribution(0.0, range_mask);
-    int x1, y1, x2, y2;
-
+    if (!_blurred.empty() || _gray.empty())
+        return;
 
-    for (int i = 0; i < len_desc; i++)
+    if (_blurSize > 1)
     {
-        x1 = (int)distribution(generator) % (range_mask + 1);
-        y1 = (int)distribution(generator) % (range_mask + 1);
-        x2 = (int)distribution(generator) % (range_mask + 1);
-        y2 = (int)distribution(generator) % (range_mask + 1);
-
-        _pairPixels.push_back(cv::Point(x1,y1));
-        _pairPixels.push_back(cv::Point(x2, y2));
+        cv::GaussianBlur(_gray, _blurBuffer, cv::Size(_blurSize, _blurSize), 0, 0);
+        _blurred = _blurBuffer;
     }
+    else
+    {
+        _blurred = _gray;
+    }
+}
 
+void corner_detector_fast::detect(cv::InputArray _image, CV_OUT std::vector<cv::KeyPoint>& keypoints, cv::InputArray _mask)
+{
+    prepareImage(_image);
+    detectPrepared(keypoints, _mask.getMat());
 }
 
-void corner_detector_fast::detect(cv::InputArray _image, CV_OUT std::vector<cv::KeyPoint>& keypoints, cv::InputArray /*mask = cv::noArray()*/)
+void corner_detector_fast::detectPrepared(std::vector<cv::KeyPoint>& keypoints, const cv::Mat& mask)
 {
     keypoints.clear();
-    int t = 15;
-    int N = 11;
-    cv::Mat image;
-    _image.getMat().copyTo(image);
-    cv::cvtColor(image, image, cv::COLOR_BGR2GRAY);
-    cv::GaussianBlur(image, image, cv::Size(5, 5), 0, 0);
-    cv::copyMakeBorder(image, image, radius, radius, radius, radius, cv::BORDER_REPLICATE);
+    if (_gray.empty())
+        return;
+    CV_Assert(mask.empty() || (mask.type() == CV_8UC1 && mask.size() == _gray.size()));
 
-    for (int i = radius; i < image.rows - radius; i++)
+    const int t = _threshold;
+    const int N = _arcLength;
+    buildPyramid(_nLevels);
+
+    // every level is split into horizontal bands, bands of all levels are detected in parallel
+    // and merged in level and row order, so result does not depend on threads count
+    struct band
+    {
+        int level;
+        int row_begin;
+        int row_end;
+    };
+    std::vector<band> bands;
+    for (int l = 0; l < _nLevels; ++l)
     {
-        for (int j = radius; j < image.cols - radius; j++)
+        // circle of pixels within radius of the border leaves the image, such pixels are not tested
+        const cv::Mat& image = _pyramid[l].image;
+        if (image.rows <= 2 * radius || image.cols <= 2 * radius)
+            break;
+
+        buildSpans(mask, _pyramid[l]);
+        const int rows = image.rows - 2 * radius;
+        const int count = std::max(1, std::min(4 * cv::getNumThreads(), rows / _minBandRows));
+        for (int b = 0; b < count; ++b)
+            bands.push_back({l, radius + rows * b / count, radius + rows * (b + 1) / count});
+    }
+    std::vector<std::vector<cv::KeyPoint>> bandKeypoints(bands.size());
+
+    const cv::Size size = _gray.size();
+    const cv::Size grid(_gridCols, _gridRows);
+    const int cellQuota = (_maxKeypoints + grid.area() - 1) / grid.area();
+
+    cv::parallel_for_(cv::Range(0, static_cast<int>(bands.size())), [&](const cv::Range& range) {
+        for (int b = range.start; b < range.end; ++b)
         {
-            if (checkPixel(image, i, j, N, t))
-                keypoints.emplace_back(cv::Point(j - 3, i - 3), radius + 3);
+            detectRows(_pyramid[bands[b].level], bands[b].row_begin, bands[b].row_end, N, t, bandKeypoints[b]);
+            if (_maxKeypoints > 0)
+                retainBest(bandKeypoints[b], cellQuota, grid, size);
         }
+    });
+
+    for (const auto& band_keypoints : bandKeypoints)
+        keypoints.insert(keypoints.end(), band_keypoints.begin(), band_keypoints.end());
+
+    if (_maxKeypoints > 0)
+    {
+        // band heaps hold a superset of the best keypoints of every cell, so the result does not depend on bands
+        retainBest(keypoints, cellQuota, grid, size);
+        retainBest(keypoints, _maxKeypoints, cv::Size(1, 1), size);
+        std::sort(keypoints.begin(), keypoints.end(), [](const cv::KeyPoint& a, const cv::KeyPoint& b) {
+            if (a.octave != b.octave)
+                return a.octave < b.octave;
+            return a.pt.y < b.pt.y || (a.pt.y == b.pt.y && a.pt.x < b.pt.x);
+        });
     }
 }
 
 void corner_detector_fast::compute(cv::InputArray _image, std::vector<cv::KeyPoint>& keypoints, cv::OutputArray descriptors)
 {
-    cv::Mat image;
-    _image.getMat().copyTo(image);
-    cv::cvtColor(image, image, cv::COLOR_BGR2GRAY);
-    cv::GaussianBlur(image, image, cv::Size(5, 5), 0, 0);
+    prepareImage(_image);
+    computePrepared(keypoints, descriptors);
+}
+
+void corner_detector_fast::computePrepared(std::vector<cv::KeyPoint>& keypoints, cv::OutputArray descriptors)
+{
+    if (_gray.empty())
+    {
+        keypoints.clear();
+        descriptors.release();
+        return;
+    }
+
     //Бинарный дескриптор BRIEF
-    const int s = 25; //Размер окрестности особой точки SxS
-    const int desc_length = 16;
+    const int s = _patchSize; //Размер окрестности особой точки SxS
+    const int desc_length = descriptorSize(); // packed bytes, compatible with cv::NORM_HAMMING
 
-    if (_pairPixels.empty())
+    if (_oriented && _rotatedPairs.empty())
     {
-        generateNormPoints(s, desc_length * 16); //Генерация пар пикселей
+        rotatePattern(s);
     }
 
-    descriptors.create(static_cast<int>(keypoints.size()), desc_length, CV_16U);
+    descriptors.create(static_cast<int>(keypoints.size()), desc_length, CV_8U);
     auto desc_mat = descriptors.getMat();
-    desc_mat.setTo(0);
-    int half_s = s / 2 + 1;
-    cv::copyMakeBorder(image, image, half_s, half_s, half_s, half_s, cv::BORDER_REPLICATE);
-    uint16_t* ptr = reinterpret_cast<uint16_t*>(desc_mat.ptr());
+    // rotated pattern reaches further from the keypoint
+    const int reach = _oriented ? _orientedReach : s / 2;
+
+    // keypoints are sampled on pyramid level they were detected at
+    int levels = 1;
+    for (const auto& kp : keypoints)
+        levels = std::max(levels, std::min(kp.octave, _nLevels - 1) + 1);
+    const int count = static_cast<int>(keypoints.size());
+
+    if (_boxSampling)
+    {
+        // box sums smooth the image themselves, levels are resized from unblurred image and the frame is never blurred
+        buildBoxPyramid(levels);
+        const int window = 2 * (reach + _boxSize / 2) + 1;
+        updateBoxOffsets(window);
+
+        const auto describeBoxRange = [&](const cv::Range& range) {
+            std::vector<uchar> patch(window * window);
+            std::vector<int> sums((window + 1) * (window + 1));
+            for (int k = range.start; k < range.end; ++k)
+            {
+                const int octave = std::max(0, std::min(keypoints[k].octave, levels - 1));
+                const pyramid_level& level = _boxPyramid[octave];
+                extractPatch(level.image, samplingCenter(keypoints[k], level), window, patch.data());
+                if (_oriented)
+                    keypoints[k].angle = orientation(patch.data() + (window / 2) * window + window / 2, window);
+                describeBox(patch.data(), window, sums.data(), keypoints[k].angle, desc_mat.ptr<uint8_t>(k));
+            }
+        };
+        if (count < _minParallelKeypoints)
+            describeBoxRange(cv::Range(0, count));
+        else
+            cv::parallel_for_(cv::Range(0, count), describeBoxRange, std::ceil(double(count) / _minParallelKeypoints));
+        return;
+    }
+
+    buildPyramid(levels);
+    for (int l = 0; l < levels; ++l)
+        updatePairOffsets(_pyramid[l]);
 
-    for (auto featPoint : keypoints)
+    // keypoints closer than reach to the border are sampled from a copy of their patch with replicated border
+    const int window = 2 * reach + 1;
+    if (_patchWindow != window)
     {
-        featPoint.pt.x += half_s;
-        featPoint.pt.y += half_s;
+        patternOffsets(window, _patchOffsets);
+        _patchWindow = window;
+    }
 
-        int indx = 0;
-        for (int i = 0; i < desc_length; i++)
+    // descriptors are independent, every task writes its own rows of output
+    const auto describeRange = [&](const cv::Range& range) {
+        std::vector<uchar> patch;
+        for (int k = range.start; k < range.end; ++k)
         {
-            uint16_t descrpt = 0;
-            for (int j = 0; j < 2*8; j++)
+            const int octave = std::max(0, std::min(keypoints[k].octave, levels - 1));
+            const cv::Mat& image = _pyramid[octave].image;
+            const cv::Point c = samplingCenter(keypoints[k], _pyramid[octave]);
+
+            const uchar* center = nullptr;
+            int step = 0;
+            const int* offsets = nullptr;
+            if (c.x >= reach && c.y >= reach && c.x + reach < image.cols && c.y + reach < image.rows)
             {
-                uint8_t pix1 = image.at<uint8_t>(featPoint.pt + _pairPixels[indx]);
-                uint8_t pix2 = image.at<uint8_t>(featPoint.pt + _pairPixels[indx+1]);
-                int bit = (pix1 < pix2);
-                descrpt |= bit << (15-j);
-                indx += 2;
+                center = image.ptr<uchar>(c.y) + c.x;
+                step = static_cast<int>(image.step);
+                offsets = _pyramid[octave].pairOffsets.data();
             }
-            *ptr = descrpt;
-            ++ptr;
+            else
+            {
+                patch.resize(window * window);
+                extractPatch(image, c, window, patch.data());
+                center = patch.data() + reach * window + reach;
+                step = window;
+                offsets = _patchOffsets.data();
+            }
+
+            if (_oriented)
+                keypoints[k].angle = orientation(center, step);
+            describe(center, offsets, keypoints[k].angle, desc_mat.ptr<uint8_t>(k));
+        }
+    };
+    if (count < _minParallelKeypoints)
+        describeRange(cv::Range(0, count));
+    else
+        cv::parallel_for_(cv::Range(0, count), describeRange, std::ceil(double(count) / _minParallelKeypoints));
+}
+
+cv::Point corner_detector_fast::samplingCenter(const cv::KeyPoint& kp, const pyramid_level& level) const
+{
+    return cv::Point(cvRound(kp.pt.x / level.scale), cvRound(kp.pt.y / level.scale));
+}
+
+float corner_detector_fast::orientation(const uchar* center, int step) const
+{
+    // direction from keypoint to intensity centroid of circular patch
+    const int r = static_cast<int>(_umax.size()) - 1;
+    int m01 = 0, m10 = 0;
+    for (int v = -r; v <= r; ++v)
+    {
+        const uchar* row = center + v * step;
+        const int d = _umax[std::abs(v)];
+        int sum = 0;
+        for (int u = -d; u <= d; ++u)
+        {
+            m10 += u * row[u];
+            sum += row[u];
         }
+        m01 += v * sum;
     }
+    return cv::fastAtan2(float(m01), float(m10));
+}
+
+size_t corner_detector_fast::patternStart(float angle) const
+{
+    if (!_oriented)
+        return 0;
+
+    // pattern pre-rotated to the nearest angle bin
+    const int bin = cvRound(angle * _angleBins / 360.f) % _angleBins;
+    return (bin < 0 ? bin + _angleBins : bin) * _pairPixels.size();
+}
+
+void corner_detector_fast::describe(const uchar* center, const int* offsets, float angle, uint8_t* desc) const
+{
+    const int* offset = offsets + patternStart(angle);
+    for (int i = 0; i < descriptorSize(); i++)
+    {
+        uint8_t descrpt = 0;
+        for (int j = 0; j < 8; j++)
+        {
+            descrpt |= static_cast<uint8_t>((center[offset[0]] < center[offset[1]]) << (7 - j));
+            offset += 2;
+        }
+        desc[i] = descrpt;
+    }
+}
+
+void corner_detector_fast::patternOffsets(int step, std::vector<int>& offsets) const
+{
+    // oriented mode keeps offsets of all rotated patterns
+    const size_t count = _oriented ? _rotatedPairs.size() : _pairPixels.size();
+    offsets.resize(count);
+    for (size_t k = 0; k < count; ++k)
+    {
+        const cv::Point p = _oriented ? _rotatedPairs[k] : cv::Point(cvRound(_pairPixels[k].x), cvRound(_pairPixels[k].y));
+        offsets[k] = p.y * step + p.x;
+    }
+}
+
+void corner_detector_fast::updateBoxOffsets(int window)
+{
+    if (_boxWindow == window)
+        return;
+
+    // box centered at sampling point, its top-left corner in integral image of patch centered at keypoint
+    const int step = window + 1;
+    const int corner = window / 2 - _boxSize / 2;
+    patternOffsets(step, _boxOffsets);
+    for (auto& offset : _boxOffsets)
+        offset += corner * step + corner;
+    _boxWindow = window;
+}
+
+void corner_detector_fast::extractPatch(const cv::Mat& image, cv::Point center, int window, uchar* patch) const
+{
+    const int half = window / 2;
+    const int x0 = center.x - half;
+    const int y0 = center.y - half;
+
+    const bool inside = x0 >= 0 && y0 >= 0 && x0 + window <= image.cols && y0 + window <= image.rows;
+    for (int y = 0; y < window; ++y, patch += window)
+    {
+        const uchar* row = image.ptr<uchar>(std::min(std::max(y0 + y, 0), image.rows - 1));
+        if (inside)
+        {
+            std::copy(row + x0, row + x0 + window, patch);
+            continue;
+        }
+        for (int x = 0; x < window; ++x)
+            patch[x] = row[std::min(std::max(x0 + x, 0), image.cols - 1)];
+    }
+}
+
+void corner_detector_fast::describeBox(const uchar* patch, int window, int* sums, float angle, uint8_t* desc) const
+{
+    // integral image of patch, sums[y * step + x] is sum of patch pixels above and to the left of (x, y)
+    const int step = window + 1;
+    std::fill(sums, sums + step, 0);
+    for (int y = 0; y < window; ++y)
+    {
+        const int* prev = sums + y * step;
+        int* row = sums + (y + 1) * step;
+        row[0] = 0;
+        int acc = 0;
+        for (int x = 0; x < window; ++x)
+        {
+            acc += patch[y * window + x];
+            row[x + 1] = prev[x + 1] + acc;
+        }
+    }
+
+    // all boxes have equal area, so comparing sums is comparing mean intensities
+    const int* offset = _boxOffsets.data() + patternStart(angle);
+    const int right = _boxSize;
+    const int bottom = _boxSize * step;
+    const auto boxSum = [&](int o) { return sums[o + bottom + right] - sums[o + right] - sums[o + bottom] + sums[o]; };
+    for (int i = 0; i < descriptorSize(); i++)
+    {
+        uint8_t descrpt = 0;
+        for (int j = 0; j < 8; j++)
+        {
+            descrpt |= static_cast<uint8_t>((boxSum(offset[0]) < boxSum(offset[1])) << (7 - j));
+            offset += 2;
+        }
+        desc[i] = descrpt;
+    }
+}
+
+void corner_detector_fast::updatePairOffsets(pyramid_level& level) const
+{
+    const size_t count = _oriented ? _rotatedPairs.size() : _pairPixels.size();
+    if (level.pairOffsetsStep == level.image.step && level.pairOffsets.size() == count)
+        return;
+
+    patternOffsets(static_cast<int>(level.image.step), level.pairOffsets);
+    level.pairOffsetsStep = level.image.step;
 }
 
-void corner_detector_fast::detectAndCompute(cv::InputArray image, cv::InputArray, std::vector<cv::KeyPoint>& keypoints, cv::OutputArray descriptors, bool /*= false*/)
+void corner_detector_fast::detectAndCompute(cv::InputArray image, cv::InputArray mask, std::vector<cv::KeyPoint>& keypoints,
+                                            cv::OutputArray descriptors, bool useProvidedKeypoints)
 {
-    detect(image, keypoints);
-    compute(image, keypoints, descriptors);
+    // grayscale and blurred images are built once for both stages
+    prepareImage(image);
+    if (!useProvidedKeypoints)
+        detectPrepared(keypoints, mask.getMat());
+    computePrepared(keypoints, descriptors);
 }
 
 } // namespace cvlib
@@ -6,79 +6,462 @@
 
 #include "cvlib.hpp"
 
+#include <opencv2/core/hal/hal.hpp>
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+/// \brief query rows matched together against one block of train rows
+constexpr int queryBlockRows = 32;
+/// \brief train rows kept in cache while query block is matched, 8 KB of 32-byte descriptors fits L1
+constexpr int trainBlockRows = 256;
+
+/// \brief distances of query rows [q_begin, q_end) to train rows [t_begin, t_end), tile rows are trainBlockRows long
+void distanceTile(const cv::Mat& query, int q_begin, int q_end, const cv::Mat& train, int t_begin, int t_end, int* tile)
+{
+    for (int i = q_begin; i < q_end; ++i, tile += trainBlockRows)
+    {
+        // query row stays in L1 for the whole train block
+        const uint8_t* q_ptr = query.ptr<uint8_t>(i);
+        for (int j = t_begin; j < t_end; ++j)
+            tile[j - t_begin] = cvlib::descriptor_matcher::distance(q_ptr, train.ptr<uint8_t>(j), query.cols);
+    }
+}
+
+/// \brief width of substrings of multi-index hashing
+constexpr int substringBytes = 2;
+
+/// \brief key of substring s of descriptor, the last substring may be shorter
+inline uint32_t substringKey(const uint8_t* desc, int s, int bytes)
+{
+    uint32_t key = 0;
+    for (int b = s * substringBytes; b < std::min((s + 1) * substringBytes, bytes); ++b)
+        key |= static_cast<uint32_t>(desc[b]) << (8 * (b - s * substringBytes));
+    return key;
+}
+
+/// \brief call probe for every key within Hamming radius r of key, flipping bits starting from first_bit, each key once
+template <typename Probe>
+void probeKeys(uint32_t key, int bits, int r, int first_bit, Probe& probe)
+{
+    probe(key);
+    if (r == 0)
+        return;
+    for (int b = first_bit; b < bits; ++b)
+        probeKeys(key ^ (1u << b), bits, r - 1, b + 1, probe);
+}
+
+/// \brief drop queries without matches if compact result is requested
+void compactMatches(std::vector<std::vector<cv::DMatch>>& matches, bool compact)
+{
+    if (compact)
+        matches.erase(std::remove_if(matches.begin(), matches.end(), [](const std::vector<cv::DMatch>& m) { return m.empty(); }), matches.end());
+}
+
+/// \brief insert train row j into k nearest ones sorted by distance, equal distances keep earlier rows first
+inline void insertNearest(int* dist, int* idx, int k, int d, int j)
+{
+    if (d >= dist[k - 1])
+        return;
+    int n = k - 1;
+    for (; n > 0 && dist[n - 1] > d; --n)
+    {
+        dist[n] = dist[n - 1];
+        idx[n] = idx[n - 1];
+    }
+    dist[n] = d;
+    idx[n] = j;
+}
+} // namespace
+
 namespace cvlib
 {
-void descriptor_matcher::knnMatchImpl(cv::InputArray queryDescriptors, std::vector<std::vector<cv::DMatch>>& matches, int k /*unhandled*/,
-                                      cv::InputArrayOfArrays masks /*unhandled*/, bool compactResult /*unhandled*/)
+void descriptor_matcher::set_index(int probe_radius)
+{
+    CV_Assert(probe_radius >= -1 && probe_radius <= 8 * substringBytes);
+    if (probe_radius >= 0 && probe_radius_ < 0)
+        trained_ = false;
+    if (probe_radius < 0)
+        index_.clear();
+    probe_radius_ = probe_radius;
+}
+
+void descriptor_matcher::add(cv::InputArrayOfArrays descriptors)
+{
+    cv::DescriptorMatcher::add(descriptors);
+    trained_ = false;
+}
+
+void descriptor_matcher::clear()
+{
+    cv::DescriptorMatcher::clear();
+    train_.release();
+    start_idx_.clear();
+    index_.clear();
+    trained_ = false;
+}
+
+void descriptor_matcher::train()
 {
-    if (trainDescCollection.empty())
+    if (trained_)
         return;
 
-    auto q_desc = queryDescriptors.getMat();
-    auto& t_desc = trainDescCollection[0];
-    int current_dist;
-    int _trainIdx;
-    int _distance = ratio_;
-    bool flag;
+    int rows = 0;
+    train_cols_ = 0;
+    start_idx_.resize(trainDescCollection.size());
+    for (size_t img = 0; img < trainDescCollection.size(); ++img)
+    {
+        const cv::Mat& desc = trainDescCollection[img];
+        start_idx_[img] = rows;
+        if (desc.empty())
+            continue;
+        CV_Assert(desc.type() == CV_8U && (train_cols_ == 0 || desc.cols == train_cols_));
+        train_cols_ = desc.cols;
+        rows += desc.rows;
+    }
 
-    matches.resize(q_desc.rows);
+    // one contiguous buffer, so search over many images walks memory as a single image does
+    train_.create(rows, static_cast<int>(cv::alignSize(std::max(train_cols_, 1), 8)), CV_8U);
+    for (size_t img = 0; img < trainDescCollection.size(); ++img)
+    {
+        const cv::Mat& desc = trainDescCollection[img];
+        for (int i = 0; i < desc.rows; ++i)
+            std::memcpy(train_.ptr<uint8_t>(start_idx_[img] + i), desc.ptr<uint8_t>(i), train_cols_);
+    }
+    if (probe_radius_ >= 0)
+        buildIndex();
+    trained_ = true;
+}
+
+void descriptor_matcher::buildIndex()
+{
+    const int tables = (train_cols_ + substringBytes - 1) / substringBytes;
+    const int buckets = 1 << (8 * substringBytes);
+    index_.resize(tables);
+
+    // counting sort of rows by key, tables are independent
+    cv::parallel_for_(cv::Range(0, tables), [&](const cv::Range& range) {
+        for (int s = range.start; s < range.end; ++s)
+        {
+            hash_table& table = index_[s];
+            table.offsets.assign(buckets + 1, 0);
+            for (int j = 0; j < train_.rows; ++j)
+                ++table.offsets[substringKey(train_.ptr<uint8_t>(j), s, train_cols_) + 1];
+            for (int b = 0; b < buckets; ++b)
+                table.offsets[b + 1] += table.offsets[b];
+
+            table.ids.resize(train_.rows);
+            std::vector<int> fill(table.offsets.begin(), table.offsets.end() - 1);
+            for (int j = 0; j < train_.rows; ++j)
+                table.ids[fill[substringKey(train_.ptr<uint8_t>(j), s, train_cols_)]++] = j;
+        }
+    });
+}
 
-    cv::RNG rnd;
-    for (int i = 0; i < q_desc.rows; ++i)
+void descriptor_matcher::indexCandidates(const uint8_t* q_desc, std::vector<int>& candidates) const
+{
+    candidates.clear();
+    for (int s = 0; s < static_cast<int>(index_.size()); ++s)
     {
-        _trainIdx = 0;
-        _distance = ratio_;
-        flag = false;
+        const hash_table& table = index_[s];
+        const int bits = 8 * (std::min((s + 1) * substringBytes, train_cols_) - s * substringBytes);
+        auto probe = [&](uint32_t key) {
+            candidates.insert(candidates.end(), table.ids.begin() + table.offsets[key], table.ids.begin() + table.offsets[key + 1]);
+        };
+        probeKeys(substringKey(q_desc, s, train_cols_), bits, std::min(probe_radius_, bits), 0, probe);
+    }
+
+    // row found in several tables is compared once, ascending order keeps ties as in brute-force search
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+}
 
-        // \todo implement Ratio of SSD check.
-        for (int j = 0; j < t_desc.rows; j++)
+void descriptor_matcher::knnIndex(const cv::Mat& q_desc, int k, std::vector<std::vector<cv::DMatch>>& matches) const
+{
+    const int nearest = std::max(k, 2);
+    // rows that are not candidates differ in more than probe radius bits of every substring
+    const int missed = (probe_radius_ + 1) * static_cast<int>(index_.size());
+    cv::parallel_for_(cv::Range(0, q_desc.rows), [&](const cv::Range& range) {
+        std::vector<int> candidates;
+        std::vector<int> dist(nearest);
+        std::vector<int> idx(nearest);
+        for (int i = range.start; i < range.end; ++i)
         {
-            current_dist = distance(q_desc.row(i), t_desc.row(j));
+            const uint8_t* q_ptr = q_desc.ptr<uint8_t>(i);
+            indexCandidates(q_ptr, candidates);
+            std::fill(dist.begin(), dist.end(), INT_MAX);
+            std::fill(idx.begin(), idx.end(), -1);
+            for (int j : candidates)
+                insertNearest(dist.data(), idx.data(), nearest, distance(q_ptr, train_.ptr<uint8_t>(j), train_cols_, dist[nearest - 1]), j);
+            // second nearest row may be one of the missed rows, the query is ambiguous unless they are all far enough
+            if (ratio_ > 1 && static_cast<int>(candidates.size()) < train_.rows && missed <= ratio_ * dist[0])
+                continue;
+            appendNearest(i, dist.data(), idx.data(), k, nullptr, matches[i]);
+        }
+    }, (q_desc.rows + queryBlockRows - 1) / queryBlockRows);
+}
 
-            if (current_dist < _distance)
+void descriptor_matcher::radiusIndex(const cv::Mat& q_desc, int bound, std::vector<std::vector<cv::DMatch>>& matches) const
+{
+    cv::parallel_for_(cv::Range(0, q_desc.rows), [&](const cv::Range& range) {
+        std::vector<int> candidates;
+        for (int i = range.start; i < range.end; ++i)
+        {
+            const uint8_t* q_ptr = q_desc.ptr<uint8_t>(i);
+            indexCandidates(q_ptr, candidates);
+            for (int j : candidates)
             {
-                flag = true;
-                _distance = current_dist;
-                _trainIdx = j;
+                const int dist = distance(q_ptr, train_.ptr<uint8_t>(j), train_cols_, bound);
+                if (dist < bound)
+                    matches[i].push_back(toMatch(i, j, dist));
             }
+            std::stable_sort(matches[i].begin(), matches[i].end(), [](const cv::DMatch& a, const cv::DMatch& b) { return a.distance < b.distance; });
         }
+    }, (q_desc.rows + queryBlockRows - 1) / queryBlockRows);
+}
 
-        if (flag)
-            matches[i].emplace_back(i, _trainIdx, _distance);
-    }
+void descriptor_matcher::appendNearest(int query_idx, const int* dist, const int* idx, int k, const int* rows,
+                                       std::vector<cv::DMatch>& query_matches) const
+{
+    // ambiguous query, second nearest row is about as close as the nearest one, exact duplicates included
+    if (ratio_ > 1 && idx[1] >= 0 && dist[1] <= ratio_ * dist[0])
+        return;
 
+    query_matches.reserve(k);
+    for (int n = 0; n < k && idx[n] >= 0; ++n)
+        query_matches.push_back(toMatch(query_idx, rows ? rows[idx[n]] : idx[n], dist[n]));
 }
 
-void descriptor_matcher::radiusMatchImpl(cv::InputArray queryDescriptors, std::vector<std::vector<cv::DMatch>>& matches, float /*maxDistance*/,
-                                         cv::InputArrayOfArrays masks /*unhandled*/, bool compactResult /*unhandled*/)
+void descriptor_matcher::applyMasks(cv::InputArrayOfArrays masks, int query_rows, cv::Mat& search, std::vector<int>& rows,
+                                    cv::Mat& pair_mask) const
 {
-    // \todo implement matching with "maxDistance"
-    knnMatchImpl(queryDescriptors, matches, 1, masks, compactResult);
+    search = train_;
+    rows.clear();
+    pair_mask.release();
+
+    std::vector<cv::Mat> image_masks;
+    if (!masks.empty())
+        masks.getMatVector(image_masks);
+    if (std::all_of(image_masks.begin(), image_masks.end(), [](const cv::Mat& mask) { return mask.empty(); }))
+        return;
+    CV_Assert(image_masks.size() == trainDescCollection.size());
+
+    // train rows masked out for every query are dropped from the search, rows allowed for some queries only need pair mask
+    bool pairwise = false;
+    std::vector<cv::Mat> allowed(image_masks.size());
+    for (size_t img = 0; img < image_masks.size(); ++img)
+    {
+        const cv::Mat& mask = image_masks[img];
+        const int train_rows = trainDescCollection[img].rows;
+        if (mask.empty())
+        {
+            for (int j = 0; j < train_rows; ++j)
+                rows.push_back(start_idx_[img] + j);
+            continue;
+        }
+        CV_Assert(mask.type() == CV_8U && mask.rows == query_rows && mask.cols == train_rows);
+
+        cv::Mat everyone;
+        cv::reduce(mask, allowed[img], 0, cv::REDUCE_MAX);
+        cv::reduce(mask, everyone, 0, cv::REDUCE_MIN);
+        for (int j = 0; j < train_rows; ++j)
+        {
+            if (allowed[img].at<uint8_t>(j) == 0)
+                continue;
+            rows.push_back(start_idx_[img] + j);
+            pairwise = pairwise || everyone.at<uint8_t>(j) == 0;
+        }
+    }
+
+    const int count = static_cast<int>(rows.size());
+    if (count == train_.rows)
+    {
+        // every row is kept, rows are the identity and train_ is searched in place
+        rows.clear();
+    }
+    else
+    {
+        // search still refers to train_, release it so that rows are copied into a buffer of its own
+        search.release();
+        search.create(count, train_.cols, CV_8U);
+        for (int c = 0; c < count; ++c)
+            std::memcpy(search.ptr<uint8_t>(c), train_.ptr<uint8_t>(rows[c]), train_.cols);
+    }
+
+    if (!pairwise)
+        return;
+    pair_mask.create(query_rows, count, CV_8U);
+    int c = 0;
+    for (size_t img = 0; img < image_masks.size(); ++img)
+    {
+        const cv::Mat& mask = image_masks[img];
+        for (int j = 0; j < trainDescCollection[img].rows; ++j)
+        {
+            if (!mask.empty() && allowed[img].at<uint8_t>(j) == 0)
+                continue;
+            for (int i = 0; i < query_rows; ++i)
+                pair_mask.at<uint8_t>(i, c) = mask.empty() || mask.at<uint8_t>(i, j) != 0;
+            ++c;
+        }
+    }
 }
 
-int descriptor_matcher::distance(const cv::Mat& q_desc, const cv::Mat& t_desc)
+cv::DMatch descriptor_matcher::toMatch(int query_idx, int row, int distance) const
 {
-    int dist = 0;
-    int length = q_desc.cols;
-    uint16_t bytes_q, bytes_t;
-    bool bit_q, bit_t;
+    const int img = static_cast<int>(std::upper_bound(start_idx_.begin(), start_idx_.end(), row) - start_idx_.begin()) - 1;
+    return cv::DMatch(query_idx, row - start_idx_[img], img, static_cast<float>(distance));
+}
 
-    for (int i = 0; i < length; ++i)
+void descriptor_matcher::knnMatchImpl(cv::InputArray queryDescriptors, std::vector<std::vector<cv::DMatch>>& matches, int k,
+                                      cv::InputArrayOfArrays masks, bool compactResult)
+{
+    train();
+    auto q_desc = queryDescriptors.getMat();
+    cv::Mat t_desc, pair_mask;
+    std::vector<int> rows;
+    applyMasks(masks, q_desc.rows, t_desc, rows, pair_mask);
+    matches.clear();
+    matches.resize(q_desc.rows);
+    if (t_desc.empty())
+    {
+        compactMatches(matches, compactResult);
+        return;
+    }
+    CV_Assert(q_desc.type() == CV_8U && q_desc.cols == train_cols_ && k > 0);
+    // index covers all rows of train_, masked search runs brute force over compacted or pair-masked rows
+    if (!index_.empty() && rows.empty() && pair_mask.empty())
     {
-        bytes_q = q_desc.at<uint16_t>(0, i);
-        bytes_t = t_desc.at<uint16_t>(0, i);
+        knnIndex(q_desc, k, matches);
+        compactMatches(matches, compactResult);
+        return;
+    }
+
+    // ratio test needs the second nearest row even for k = 1
+    const int nearest = std::max(k, 2);
 
-        for (int j = 0; j < 16; ++j)
+    // query blocks are independent, every task fills matches of its own queries only
+    const int blocks = (q_desc.rows + queryBlockRows - 1) / queryBlockRows;
+    cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range& range) {
+        std::vector<int> tile(queryBlockRows * trainBlockRows);
+        std::vector<int> dist(queryBlockRows * nearest);
+        std::vector<int> idx(queryBlockRows * nearest);
+        for (int block = range.start; block < range.end; ++block)
         {
-            bit_q = (((bytes_q) << (15 - j))&0xFFFF) >> 15;
-            bit_t = (((bytes_t) << (15 - j))&0xFFFF) >> 15;
+            const int q_begin = block * queryBlockRows;
+            const int q_end = std::min(q_begin + queryBlockRows, q_desc.rows);
+            std::fill(dist.begin(), dist.end(), INT_MAX);
+            std::fill(idx.begin(), idx.end(), -1);
 
-            if (bit_q != bit_t)
-                dist++;
+            // query block against train block, distances of a tile are computed before they are scanned
+            for (int t_begin = 0; t_begin < t_desc.rows; t_begin += trainBlockRows)
+            {
+                const int t_end = std::min(t_begin + trainBlockRows, t_desc.rows);
+                distanceTile(q_desc, q_begin, q_end, t_desc, t_begin, t_end, tile.data());
+                for (int i = 0; i < q_end - q_begin; ++i)
+                {
+                    const int* row = tile.data() + i * trainBlockRows;
+                    if (pair_mask.empty())
+                    {
+                        for (int j = 0; j < t_end - t_begin; ++j)
+                            insertNearest(&dist[i * nearest], &idx[i * nearest], nearest, row[j], t_begin + j);
+                        continue;
+                    }
+                    const uint8_t* allowed = pair_mask.ptr<uint8_t>(q_begin + i) + t_begin;
+                    for (int j = 0; j < t_end - t_begin; ++j)
+                    {
+                        if (allowed[j])
+                            insertNearest(&dist[i * nearest], &idx[i * nearest], nearest, row[j], t_begin + j);
+                    }
+                }
+            }
+
+            for (int i = 0; i < q_end - q_begin; ++i)
+                appendNearest(q_begin + i, &dist[i * nearest], &idx[i * nearest], k, rows.empty() ? nullptr : rows.data(), matches[q_begin + i]);
         }
+    }, blocks);
+    compactMatches(matches, compactResult);
+}
 
+void descriptor_matcher::radiusMatchImpl(cv::InputArray queryDescriptors, std::vector<std::vector<cv::DMatch>>& matches, float maxDistance,
+                                         cv::InputArrayOfArrays masks, bool compactResult)
+{
+    train();
+    auto q_desc = queryDescriptors.getMat();
+    cv::Mat t_desc, pair_mask;
+    std::vector<int> rows;
+    applyMasks(masks, q_desc.rows, t_desc, rows, pair_mask);
+    matches.clear();
+    matches.resize(q_desc.rows);
+    if (t_desc.empty())
+    {
+        compactMatches(matches, compactResult);
+        return;
+    }
+    CV_Assert(q_desc.type() == CV_8U && q_desc.cols == train_cols_ && maxDistance >= 0);
+    // distances are integer, d < maxDistance is the same as d < bound, larger radii are clamped to keep the cast defined
+    const int bound = static_cast<int>(std::ceil(std::min<double>(maxDistance, 8 * q_desc.cols + 1)));
+    // index covers all rows of train_, masked search runs brute force over compacted or pair-masked rows
+    if (!index_.empty() && rows.empty() && pair_mask.empty())
+    {
+        radiusIndex(q_desc, bound, matches);
+        compactMatches(matches, compactResult);
+        return;
     }
 
+    // query blocks are independent, every task fills matches of its own queries only
+    const int blocks = (q_desc.rows + queryBlockRows - 1) / queryBlockRows;
+    cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range& range) {
+        for (int block = range.start; block < range.end; ++block)
+        {
+            const int q_begin = block * queryBlockRows;
+            const int q_end = std::min(q_begin + queryBlockRows, q_desc.rows);
+
+            // train block stays in cache while query block is matched against it
+            for (int t_begin = 0; t_begin < t_desc.rows; t_begin += trainBlockRows)
+            {
+                const int t_end = std::min(t_begin + trainBlockRows, t_desc.rows);
+                for (int i = q_begin; i < q_end; ++i)
+                {
+                    const uint8_t* q_ptr = q_desc.ptr<uint8_t>(i);
+                    const uint8_t* allowed = pair_mask.empty() ? nullptr : pair_mask.ptr<uint8_t>(i);
+                    for (int j = t_begin; j < t_end; ++j)
+                    {
+                        if (allowed && !allowed[j])
+                            continue;
+                        const int dist = distance(q_ptr, t_desc.ptr<uint8_t>(j), q_desc.cols, bound);
+                        if (dist < bound)
+                            matches[i].push_back(toMatch(i, rows.empty() ? j : rows[j], dist));
+                    }
+                }
+            }
+
+            // matches of every query are in train order, stable sort keeps it for equal distances
+            for (int i = q_begin; i < q_end; ++i)
+                std::stable_sort(matches[i].begin(), matches[i].end(),
+                                 [](const cv::DMatch& a, const cv::DMatch& b) { return a.distance < b.distance; });
+        }
+    }, blocks);
+    compactMatches(matches, compactResult);
+}
+
+int descriptor_matcher::distance(const uint8_t* q_desc, const uint8_t* t_desc, int bytes, int bound)
+{
+    // chunk by chunk, most of pairs in short-radius search are rejected after the first chunks
+    constexpr int chunk = 8;
+    int dist = 0;
+    for (int i = 0; i < bytes && dist < bound; i += chunk)
+        dist += cv::hal::normHamming(q_desc + i, t_desc + i, std::min(chunk, bytes - i));
+
     return dist;
 }
+
+int descriptor_matcher::distance(const uint8_t* q_desc, const uint8_t* t_desc, int bytes)
+{
+    // OpenCV kernel uses hardware popcount or SIMD byte lookup available on the running CPU, so the build needs no CPU-specific flags
+    return cv::hal::normHamming(q_desc, t_desc, bytes);
+}
 } // namespace cvlib
@@ -0,0 +1,321 @@
+/* Vocabulary tree for binary descriptors implementation.
+ * @file
+ * @date 2018-11-25
+ * @author Anonymous
+ */
+
+#include "cvlib.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+/// \brief cluster of descriptors produced for a node
+struct cluster
+{
+    std::vector<uint8_t> center;
+    std::vector<int> members;
+};
+
+/// \brief nearest of k centers, ties go to the first one
+inline int nearestCenter(const uint8_t* desc, const std::vector<std::vector<uint8_t>>& centers, int bytes)
+{
+    int best = 0;
+    int best_dist = INT_MAX;
+    for (int c = 0; c < static_cast<int>(centers.size()); ++c)
+    {
+        const int dist = cvlib::descriptor_matcher::distance(desc, centers[c].data(), bytes, best_dist);
+        if (dist < best_dist)
+        {
+            best_dist = dist;
+            best = c;
+        }
+    }
+    return best;
+}
+
+/// \brief k-majority clustering: Hamming assignment, every center bit is the majority bit of its members
+/// \param seed, in - seed of k-means++ seeding, fixed per node so result does not depend on threads
+std::vector<cluster> kMajority(const cv::Mat& descriptors, const std::vector<int>& members, int k, int iterations, uint64 seed)
+{
+    const int bytes = descriptors.cols;
+    const int n = static_cast<int>(members.size());
+    k = std::min(k, n);
+
+    // k-means++ seeding, next center is drawn with probability proportional to squared distance to chosen ones
+    cv::RNG rng(seed);
+    std::vector<std::vector<uint8_t>> centers;
+    std::vector<double> dist2(n, std::numeric_limits<double>::max());
+    int chosen = rng.uniform(0, n);
+    while (static_cast<int>(centers.size()) < k)
+    {
+        const uint8_t* c = descriptors.ptr<uint8_t>(members[chosen]);
+        centers.emplace_back(c, c + bytes);
+
+        cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& range) {
+            for (int i = range.start; i < range.end; ++i)
+            {
+                const double d = cvlib::descriptor_matcher::distance(descriptors.ptr<uint8_t>(members[i]), c, bytes);
+                dist2[i] = std::min(dist2[i], d * d);
+            }
+        });
+        // summed serially so the drawn centers do not depend on thread count
+        double total = 0;
+        for (int i = 0; i < n; ++i)
+            total += dist2[i];
+        if (total == 0)
+            break;
+        double pick = rng.uniform(0., total);
+        for (chosen = 0; chosen < n - 1 && pick >= dist2[chosen]; ++chosen)
+            pick -= dist2[chosen];
+    }
+
+    std::vector<int> assignment(n, -1);
+    std::vector<int> nearest(n);
+    std::vector<int> counts(centers.size() * bytes * 8);
+    std::vector<int> sizes(centers.size());
+    for (int it = 0; it < iterations; ++it)
+    {
+        // every member writes only its own slot, the result does not depend on scheduling
+        cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& range) {
+            for (int i = range.start; i < range.end; ++i)
+                nearest[i] = nearestCenter(descriptors.ptr<uint8_t>(members[i]), centers, bytes);
+        });
+        if (nearest == assignment)
+            break;
+        assignment.swap(nearest);
+
+        // per-bit votes of members, empty clusters keep their centers; split by descriptor bytes so counters are not shared
+        std::fill(sizes.begin(), sizes.end(), 0);
+        for (int i = 0; i < n; ++i)
+            ++sizes[assignment[i]];
+        cv::parallel_for_(cv::Range(0, bytes), [&](const cv::Range& range) {
+            for (size_t c = 0; c < centers.size(); ++c)
+                std::fill(&counts[(c * bytes + range.start) * 8], &counts[(c * bytes + range.end) * 8], 0);
+            for (int i = 0; i < n; ++i)
+            {
+                const uint8_t* desc = descriptors.ptr<uint8_t>(members[i]);
+                int* votes = &counts[assignment[i] * bytes * 8];
+                for (int b = range.start * 8; b < range.end * 8; ++b)
+                    votes[b] += (desc[b / 8] >> (7 - b % 8)) & 1;
+            }
+        });
+        for (size_t c = 0; c < centers.size(); ++c)
+        {
+            if (sizes[c] == 0)
+                continue;
+            const int* votes = &counts[c * bytes * 8];
+            for (int byte = 0; byte < bytes; ++byte)
+            {
+                uint8_t value = 0;
+                for (int b = 0; b < 8; ++b)
+                    value |= static_cast<uint8_t>((2 * votes[byte * 8 + b] > sizes[c]) << (7 - b));
+                centers[c][byte] = value;
+            }
+        }
+    }
+
+    std::vector<cluster> clusters(centers.size());
+    for (size_t c = 0; c < centers.size(); ++c)
+        clusters[c].center = centers[c];
+    for (int i = 0; i < n; ++i)
+        clusters[assignment[i] < 0 ? 0 : assignment[i]].members.push_back(members[i]);
+    clusters.erase(std::remove_if(clusters.begin(), clusters.end(), [](const cluster& c) { return c.members.empty(); }), clusters.end());
+    return clusters;
+}
+} // namespace
+
+namespace cvlib
+{
+vocabulary_tree::vocabulary_tree(int branching, int levels) : branching_(branching), levels_(levels)
+{
+    CV_Assert(branching > 1 && levels > 0);
+}
+
+void vocabulary_tree::build(const std::vector<cv::Mat>& images, int iterations)
+{
+    std::vector<cv::Mat> nonempty;
+    for (const auto& desc : images)
+    {
+        if (desc.empty())
+            continue;
+        CV_Assert(desc.type() == CV_8U && (nonempty.empty() || desc.cols == nonempty[0].cols));
+        nonempty.push_back(desc);
+    }
+    CV_Assert(!nonempty.empty());
+    cv::Mat descriptors;
+    cv::vconcat(nonempty, descriptors);
+    bytes_ = descriptors.cols;
+
+    // breadth-first build, nodes of one level are clustered in parallel and appended in order, so tree does not depend on threads
+    nodes_.assign(1, node());
+    std::vector<std::vector<uint8_t>> centers(1, std::vector<uint8_t>(bytes_, 0));
+    std::vector<std::pair<int, std::vector<int>>> level(1);
+    level[0].first = 0;
+    for (int i = 0; i < descriptors.rows; ++i)
+        level[0].second.push_back(i);
+
+    for (int depth = 0; depth < levels_ && !level.empty(); ++depth)
+    {
+        std::vector<std::vector<cluster>> split(level.size());
+        cv::parallel_for_(cv::Range(0, static_cast<int>(level.size())), [&](const cv::Range& range) {
+            for (int p = range.start; p < range.end; ++p)
+            {
+                // node with a single descriptor stays a leaf
+                if (level[p].second.size() > 1)
+                    split[p] = kMajority(descriptors, level[p].second, branching_, iterations, static_cast<uint64>(level[p].first) + 1);
+            }
+        });
+
+        std::vector<std::pair<int, std::vector<int>>> next;
+        for (size_t p = 0; p < level.size(); ++p)
+        {
+            if (split[p].size() < 2)
+                continue;
+            node& parent = nodes_[level[p].first];
+            parent.first_child = static_cast<int>(nodes_.size());
+            parent.children = static_cast<int>(split[p].size());
+            for (auto& c : split[p])
+            {
+                next.emplace_back(static_cast<int>(nodes_.size()), std::move(c.members));
+                nodes_.push_back(node());
+                centers.push_back(std::move(c.center));
+            }
+        }
+        level.swap(next);
+    }
+
+    centers_.create(static_cast<int>(nodes_.size()), bytes_, CV_8U);
+    int words = 0;
+    for (size_t n = 0; n < nodes_.size(); ++n)
+    {
+        std::copy(centers[n].begin(), centers[n].end(), centers_.ptr<uint8_t>(static_cast<int>(n)));
+        if (nodes_[n].children == 0)
+            nodes_[n].word = words++;
+    }
+
+    // inverse document frequency of word over training images
+    std::vector<int> documents(words, 0);
+    for (const auto& desc : nonempty)
+    {
+        std::vector<int> seen;
+        for (int i = 0; i < desc.rows; ++i)
+            seen.push_back(quantize(desc.ptr<uint8_t>(i)));
+        std::sort(seen.begin(), seen.end());
+        seen.erase(std::unique(seen.begin(), seen.end()), seen.end());
+        for (int w : seen)
+            ++documents[w];
+    }
+    idf_.resize(words);
+    for (int w = 0; w < words; ++w)
+        idf_[w] = documents[w] > 0 ? static_cast<float>(std::log(double(nonempty.size()) / documents[w])) : 0.f;
+
+    clear();
+}
+
+int vocabulary_tree::quantize(const uint8_t* desc) const
+{
+    CV_Assert(!nodes_.empty());
+    int n = 0;
+    while (nodes_[n].children > 0)
+    {
+        int best = nodes_[n].first_child;
+        int best_dist = INT_MAX;
+        for (int c = nodes_[n].first_child; c < nodes_[n].first_child + nodes_[n].children; ++c)
+        {
+            const int dist = descriptor_matcher::distance(desc, centers_.ptr<uint8_t>(c), bytes_, best_dist);
+            if (dist < best_dist)
+            {
+                best_dist = dist;
+                best = c;
+            }
+        }
+        n = best;
+    }
+    return nodes_[n].word;
+}
+
+std::vector<std::pair<int, float>> vocabulary_tree::bagOfWords(const cv::Mat& descriptors) const
+{
+    std::vector<std::pair<int, float>> bow;
+    if (descriptors.empty())
+        return bow;
+    CV_Assert(descriptors.type() == CV_8U && descriptors.cols == bytes_);
+
+    std::vector<int> words(descriptors.rows);
+    cv::parallel_for_(cv::Range(0, descriptors.rows), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end; ++i)
+            words[i] = quantize(descriptors.ptr<uint8_t>(i));
+    });
+
+    // term frequency times inverse document frequency, normalized to unit L1 norm
+    std::sort(words.begin(), words.end());
+    float norm = 0.f;
+    for (size_t i = 0; i < words.size();)
+    {
+        size_t j = i;
+        while (j < words.size() && words[j] == words[i])
+            ++j;
+        const float weight = static_cast<float>(j - i) * idf_[words[i]];
+        if (weight > 0.f)
+        {
+            bow.emplace_back(words[i], weight);
+            norm += weight;
+        }
+        i = j;
+    }
+    for (auto& entry : bow)
+        entry.second /= norm;
+    return bow;
+}
+
+int vocabulary_tree::add(const cv::Mat& descriptors)
+{
+    for (const auto& entry : bagOfWords(descriptors))
+        inverted_[entry.first].emplace_back(images_, entry.second);
+    return images_++;
+}
+
+void vocabulary_tree::clear()
+{
+    inverted_.assign(idf_.size(), std::vector<std::pair<int, float>>());
+    images_ = 0;
+}
+
+std::vector<std::pair<int, float>> vocabulary_tree::query(const cv::Mat& descriptors, int max_results) const
+{
+    CV_Assert(max_results >= 0);
+
+    // L1 score 1 - |q - d| / 2 of normalized vectors needs only words present in both of them:
+    // |q - d| = 2 + sum over common words of (|q_w - d_w| - q_w - d_w)
+    std::vector<float> common(images_, 0.f);
+    for (const auto& entry : bagOfWords(descriptors))
+    {
+        for (const auto& image : inverted_[entry.first])
+            common[image.first] += std::abs(entry.second - image.second) - entry.second - image.second;
+    }
+
+    std::vector<std::pair<int, float>> results;
+    for (int img = 0; img < images_; ++img)
+    {
+        if (common[img] < 0.f)
+            results.emplace_back(img, -0.5f * common[img]);
+    }
+    const auto better = [](const std::pair<int, float>& a, const std::pair<int, float>& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    };
+    if (static_cast<int>(results.size()) > max_results)
+    {
+        std::partial_sort(results.begin(), results.begin() + max_results, results.end(), better);
+        results.resize(max_results);
+    }
+    else
+    {
+        std::sort(results.begin(), results.end(), better);
+    }
+    return results;
+}
+} // namespace cvlib
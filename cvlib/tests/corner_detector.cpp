@@ -10,10 +10,46 @@
 
 using namespace cvlib;
 
+namespace
+{
+/// \brief Bresenham circle of radius 3, pixel k of it is bit k of circle masks
+const cv::Point circlePoints[16] = {{0, -3}, {1, -3}, {2, -2}, {3, -1}, {3, 0}, {3, 1}, {2, 2}, {1, 3},
+                                    {0, 3}, {-1, 3}, {-2, 2}, {-3, 1}, {-3, 0}, {-3, -1}, {-2, -2}, {-1, -3}};
+
+/// \brief bits of mask starting a run of at least N set bits, runs are counted bit by bit around the circle
+uint16_t runStarts(uint16_t mask, int N)
+{
+    uint16_t starts = 0;
+    for (int k = 0; k < 16; ++k)
+    {
+        int run = 0;
+        while (run < N && ((mask >> ((k + run) % 16)) & 1))
+            ++run;
+        if (run == N)
+            starts |= static_cast<uint16_t>(1 << k);
+    }
+    return starts;
+}
+
+/// \brief segment test of pixel (i, j) written independently of the detector
+bool isCorner(const cv::Mat& image, int i, int j, int N, int t)
+{
+    const int center = image.at<uchar>(i, j);
+    uint16_t bright = 0, dark = 0;
+    for (int k = 0; k < 16; ++k)
+    {
+        const int p = image.at<uchar>(i + circlePoints[k].y, j + circlePoints[k].x);
+        bright |= static_cast<uint16_t>((p > center + t) << k);
+        dark |= static_cast<uint16_t>((p < center - t) << k);
+    }
+    return runStarts(bright, N) != 0 || runStarts(dark, N) != 0;
+}
+} // namespace
+
 TEST_CASE("simple check", "[corner_detector_fast]")
 {
     auto fast = corner_detector_fast::create();
-    cv::Mat image(10, 10, CV_8UC1);
+    cv::Mat image = cv::Mat::zeros(10, 10, CV_8UC1);
     SECTION("empty image")
     {
         std::vector<cv::KeyPoint> out;
@@ -23,3 +59,494 @@ TEST_CASE("simple check", "[corner_detector_fast]")
 
     // \todo add 5 or more tests (SECTIONs)
 }
+
+TEST_CASE("segment test", "[corner_detector_fast]")
+{
+    auto fast = corner_detector_fast::create();
+    cv::Mat blocks(16, 17, CV_8UC3);
+    cv::RNG rng(42);
+    rng.fill(blocks, cv::RNG::UNIFORM, 0, 256);
+    cv::Mat image;
+    cv::resize(blocks, image, cv::Size(), 4, 4, cv::INTER_NEAREST);
+
+    SECTION("vectorized path matches scalar reference")
+    {
+        fast->setNonmaxSuppression(false);
+        cv::Mat ref;
+        cv::cvtColor(image, ref, cv::COLOR_BGR2GRAY);
+        cv::GaussianBlur(ref, ref, cv::Size(5, 5), 0, 0);
+
+        for (int N : {9, 11, 12, 14})
+        {
+            fast->setArcLength(N);
+            std::vector<cv::KeyPoint> out;
+            fast->detect(image, out);
+
+            std::vector<cv::Point> expected;
+            for (int i = 3; i < ref.rows - 3; ++i)
+                for (int j = 3; j < ref.cols - 3; ++j)
+                    if (isCorner(ref, i, j, N, 15))
+                        expected.emplace_back(j, i);
+
+            REQUIRE(!expected.empty());
+            REQUIRE(out.size() == expected.size());
+            for (size_t k = 0; k < out.size(); ++k)
+                REQUIRE(cv::Point(out[k].pt) == expected[k]);
+        }
+    }
+
+    SECTION("parallel detection matches serial")
+    {
+        std::vector<cv::KeyPoint> parallel;
+        fast->detect(image, parallel);
+
+        const int threads = cv::getNumThreads();
+        cv::setNumThreads(1);
+        std::vector<cv::KeyPoint> serial;
+        fast->detect(image, serial);
+        cv::setNumThreads(threads);
+
+        REQUIRE(parallel.size() == serial.size());
+        for (size_t k = 0; k < serial.size(); ++k)
+            REQUIRE(parallel[k].pt == serial[k].pt);
+    }
+
+    SECTION("non-maximum suppression")
+    {
+        std::vector<cv::KeyPoint> all;
+        fast->setNonmaxSuppression(false);
+        fast->detect(image, all);
+        std::vector<cv::KeyPoint> suppressed;
+        fast->setNonmaxSuppression(true);
+        fast->detect(image, suppressed);
+
+        REQUIRE(!suppressed.empty());
+        REQUIRE(suppressed.size() < all.size());
+        for (size_t a = 0; a < suppressed.size(); ++a)
+        {
+            REQUIRE(suppressed[a].response > 0);
+            for (size_t b = a + 1; b < suppressed.size(); ++b)
+            {
+                const auto d = suppressed[a].pt - suppressed[b].pt;
+                REQUIRE(std::max(std::abs(d.x), std::abs(d.y)) > 1);
+            }
+        }
+    }
+
+    SECTION("mask and regions of interest")
+    {
+        fast->setNonmaxSuppression(false);
+        std::vector<cv::KeyPoint> all;
+        fast->detect(image, all);
+
+        const cv::Rect roi(10, 20, 30, 25);
+        cv::Mat mask = cv::Mat::zeros(image.size(), CV_8UC1);
+        mask(roi).setTo(255);
+        std::vector<cv::KeyPoint> expected;
+        for (const auto& kp : all)
+            if (roi.contains(kp.pt))
+                expected.push_back(kp);
+        REQUIRE(!expected.empty());
+
+        std::vector<cv::KeyPoint> masked;
+        fast->detect(image, masked, mask);
+        fast->setRegions({roi});
+        std::vector<cv::KeyPoint> regions;
+        fast->detect(image, regions);
+        fast->setRegions({});
+
+        REQUIRE(masked.size() == expected.size());
+        REQUIRE(regions.size() == expected.size());
+        for (size_t k = 0; k < expected.size(); ++k)
+        {
+            REQUIRE(masked[k].pt == expected[k].pt);
+            REQUIRE(regions[k].pt == expected[k].pt);
+        }
+    }
+
+    SECTION("top-k retention")
+    {
+        std::vector<cv::KeyPoint> all;
+        fast->detect(image, all);
+        REQUIRE(all.size() > 10);
+
+        fast->setMaxKeypoints(10);
+        std::vector<cv::KeyPoint> best;
+        fast->detect(image, best);
+        fast->setMaxKeypoints(0);
+
+        REQUIRE(best.size() == 10);
+        std::vector<float> responses;
+        for (const auto& kp : all)
+            responses.push_back(kp.response);
+        std::sort(responses.rbegin(), responses.rend());
+        float weakest = best[0].response;
+        for (const auto& kp : best)
+            weakest = std::min(weakest, kp.response);
+        REQUIRE(weakest == responses[9]);
+    }
+
+    SECTION("grid retention does not depend on bands")
+    {
+        cv::Mat large;
+        cv::resize(blocks, large, cv::Size(), 8, 8, cv::INTER_NEAREST);
+        std::vector<cv::KeyPoint> all;
+        fast->detect(large, all);
+
+        // 2 x 3 grid, every cell keeps its 5 strongest corners; thread count changes the number of bands
+        fast->setMaxKeypoints(30, 2, 3);
+        const int threads = cv::getNumThreads();
+        cv::setNumThreads(1);
+        std::vector<cv::KeyPoint> few_bands;
+        fast->detect(large, few_bands);
+        cv::setNumThreads(8);
+        std::vector<cv::KeyPoint> many_bands;
+        fast->detect(large, many_bands);
+        cv::setNumThreads(threads);
+        fast->setMaxKeypoints(0);
+
+        REQUIRE(many_bands.size() == few_bands.size());
+        for (size_t k = 0; k < few_bands.size(); ++k)
+            REQUIRE(many_bands[k].pt == few_bands[k].pt);
+
+        const auto cell = [&](const cv::KeyPoint& kp) {
+            return std::min(1, int(kp.pt.y) * 2 / large.rows) * 3 + std::min(2, int(kp.pt.x) * 3 / large.cols);
+        };
+        std::vector<std::vector<float>> expected(6), retained(6);
+        for (const auto& kp : all)
+            expected[cell(kp)].push_back(kp.response);
+        for (const auto& kp : few_bands)
+            retained[cell(kp)].push_back(kp.response);
+        for (int c = 0; c < 6; ++c)
+        {
+            std::sort(expected[c].rbegin(), expected[c].rend());
+            std::sort(retained[c].rbegin(), retained[c].rend());
+            expected[c].resize(std::min<size_t>(expected[c].size(), 5));
+            REQUIRE(retained[c] == expected[c]);
+        }
+    }
+}
+
+TEST_CASE("circle masks", "[circle_mask]")
+{
+    static_assert(circle_mask::hasArc(0x01FF, 9) && !circle_mask::hasArc(0x01FF, 10), "helpers are usable in constant expressions");
+    static_assert(circle_mask::arcStarts(0xC07F, 9) == 0x4000 && circle_mask::count(0xC07F) == 9, "arcs wrap around the circle");
+
+    for (int m = 0; m < 1 << 16; ++m)
+    {
+        const uint16_t mask = static_cast<uint16_t>(m);
+        int bits = 0;
+        for (int k = 0; k < 16; ++k)
+            bits += (mask >> k) & 1;
+        REQUIRE(circle_mask::count(mask) == bits);
+
+        for (int N : {9, 12})
+        {
+            const uint16_t starts = runStarts(mask, N);
+            uint16_t cover = 0;
+            for (int k = 0; k < 16; ++k)
+            {
+                if ((starts >> k) & 1)
+                    for (int l = 0; l < N; ++l)
+                        cover |= static_cast<uint16_t>(1 << ((k + l) % 16));
+            }
+            REQUIRE(circle_mask::arcStarts(mask, N) == starts);
+            REQUIRE(circle_mask::arcCover(mask, N) == cover);
+            REQUIRE(circle_mask::hasArc(mask, N) == (starts != 0));
+        }
+    }
+
+    for (int k = 1; k < 16; ++k)
+        REQUIRE(circle_mask::rotate(0x8421, k) == static_cast<uint16_t>((0x8421 >> k) | (0x8421 << (16 - k))));
+}
+
+TEST_CASE("shared preprocessing", "[corner_detector_fast]")
+{
+    auto fast = corner_detector_fast::create();
+    cv::Mat blocks(16, 17, CV_8UC3);
+    cv::RNG rng(7);
+    rng.fill(blocks, cv::RNG::UNIFORM, 0, 256);
+    cv::Mat image;
+    cv::resize(blocks, image, cv::Size(), 4, 4, cv::INTER_NEAREST);
+
+    std::vector<cv::KeyPoint> corners;
+    cv::Mat descriptors;
+    fast->detect(image, corners);
+    fast->compute(image, corners, descriptors);
+    REQUIRE(!corners.empty());
+    REQUIRE(descriptors.type() == CV_8U);
+    REQUIRE(descriptors.cols == 32);
+    REQUIRE(descriptors.rows == static_cast<int>(corners.size()));
+
+    SECTION("detectAndCompute matches detect and compute")
+    {
+        std::vector<cv::KeyPoint> joint_corners;
+        cv::Mat joint_descriptors;
+        fast->detectAndCompute(image, cv::noArray(), joint_corners, joint_descriptors);
+        REQUIRE(joint_corners.size() == corners.size());
+        REQUIRE(cv::norm(joint_descriptors, descriptors, cv::NORM_INF) == 0);
+    }
+
+    SECTION("grayscale input is used without conversion")
+    {
+        cv::Mat gray;
+        cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+        const cv::Mat reference = gray.clone();
+        std::vector<cv::KeyPoint> gray_corners;
+        cv::Mat gray_descriptors;
+        fast->detectAndCompute(gray, cv::noArray(), gray_corners, gray_descriptors);
+        REQUIRE(gray_corners.size() == corners.size());
+        REQUIRE(cv::norm(gray_descriptors, descriptors, cv::NORM_INF) == 0);
+        REQUIRE(cv::norm(gray, reference, cv::NORM_INF) == 0);
+    }
+
+    SECTION("negative octave is sampled on the first level")
+    {
+        std::vector<cv::KeyPoint> unknown = corners;
+        for (auto& kp : unknown)
+            kp.octave = -1;
+        cv::Mat unknown_descriptors;
+        fast->compute(image, unknown, unknown_descriptors);
+        REQUIRE(cv::norm(unknown_descriptors, descriptors, cv::NORM_INF) == 0);
+
+        fast->setBoxSampling(true);
+        fast->compute(image, corners, descriptors);
+        fast->compute(image, unknown, unknown_descriptors);
+        REQUIRE(cv::norm(unknown_descriptors, descriptors, cv::NORM_INF) == 0);
+    }
+
+    SECTION("parallel description matches serial")
+    {
+        std::vector<cv::KeyPoint> grid;
+        for (int y = 0; y < image.rows; y += 3)
+            for (int x = 0; x < image.cols; x += 3)
+                grid.emplace_back(cv::Point2f(float(x), float(y)), 6.f);
+        REQUIRE(grid.size() > 256);
+
+        cv::Mat parallel;
+        fast->compute(image, grid, parallel);
+
+        const int threads = cv::getNumThreads();
+        cv::setNumThreads(1);
+        cv::Mat serial;
+        fast->compute(image, grid, serial);
+        cv::setNumThreads(threads);
+
+        REQUIRE(cv::norm(parallel, serial, cv::NORM_INF) == 0);
+    }
+}
+
+TEST_CASE("multi-scale detection", "[corner_detector_fast]")
+{
+    auto fast = corner_detector_fast::create();
+    cv::Mat blocks(16, 16, CV_8UC3);
+    cv::RNG rng(11);
+    rng.fill(blocks, cv::RNG::UNIFORM, 0, 256);
+    cv::Mat image;
+    cv::resize(blocks, image, cv::Size(), 12, 12, cv::INTER_NEAREST);
+
+    std::vector<cv::KeyPoint> single;
+    fast->detect(image, single);
+
+    fast->setLevels(3);
+    fast->setScaleFactor(1.5);
+    std::vector<cv::KeyPoint> corners;
+    cv::Mat descriptors;
+    fast->detectAndCompute(image, cv::noArray(), corners, descriptors);
+
+    std::vector<int> per_octave(3, 0);
+    for (const auto& kp : corners)
+    {
+        REQUIRE(kp.octave >= 0);
+        REQUIRE(kp.octave < 3);
+        REQUIRE(kp.size == Approx(6 * std::pow(1.5, kp.octave)));
+        REQUIRE(cv::Rect(0, 0, image.cols, image.rows).contains(kp.pt));
+        ++per_octave[kp.octave];
+    }
+    REQUIRE(per_octave[0] == static_cast<int>(single.size()));
+    REQUIRE(per_octave[1] > 0);
+    REQUIRE(descriptors.rows == static_cast<int>(corners.size()));
+}
+
+TEST_CASE("oriented descriptors", "[corner_detector_fast]")
+{
+    auto fast = corner_detector_fast::create();
+    cv::Mat blocks(6, 6, CV_8UC1);
+    cv::RNG rng(5);
+    rng.fill(blocks, cv::RNG::UNIFORM, 0, 256);
+    cv::Mat image;
+    cv::resize(blocks, image, cv::Size(65, 65), 0, 0, cv::INTER_LINEAR);
+    cv::Mat rotated;
+    cv::rotate(image, rotated, cv::ROTATE_90_CLOCKWISE);
+
+    // center of odd-sized image stays in place after rotation
+    std::vector<cv::KeyPoint> kp = {cv::KeyPoint(cv::Point2f(32, 32), 6.f)};
+    std::vector<cv::KeyPoint> kp_rotated = kp;
+    cv::Mat desc, desc_rotated;
+
+    fast->compute(image, kp, desc);
+    fast->compute(rotated, kp_rotated, desc_rotated);
+    const double upright = cv::norm(desc, desc_rotated, cv::NORM_HAMMING);
+
+    fast->setOriented(true);
+    fast->compute(image, kp, desc);
+    fast->compute(rotated, kp_rotated, desc_rotated);
+    const double steered = cv::norm(desc, desc_rotated, cv::NORM_HAMMING);
+
+    const float turn = std::fmod(kp_rotated[0].angle - kp[0].angle + 360.f, 360.f);
+    REQUIRE(turn == Approx(90.f).margin(3.f));
+    REQUIRE(steered < upright);
+}
+
+TEST_CASE("box sampling", "[corner_detector_fast]")
+{
+    auto fast = corner_detector_fast::create();
+    fast->setBoxSampling(true);
+    cv::Mat image(64, 64, CV_8UC1);
+    cv::RNG rng(13);
+    rng.fill(image, cv::RNG::UNIFORM, 0, 256);
+
+    std::vector<cv::KeyPoint> kp = {cv::KeyPoint(cv::Point2f(30, 33), 6.f), cv::KeyPoint(cv::Point2f(2, 60), 6.f)};
+    cv::Mat desc;
+    fast->compute(image, kp, desc);
+    REQUIRE(desc.rows == 2);
+
+    SECTION("matches box sums of integral image")
+    {
+        cv::Mat sums;
+        cv::integral(image, sums, CV_32S);
+        const auto boxSum = [&](int x, int y) {
+            return sums.at<int>(y + 3, x + 3) - sums.at<int>(y - 2, x + 3) - sums.at<int>(y + 3, x - 2) + sums.at<int>(y - 2, x - 2);
+        };
+        const auto& pattern = fast->getPattern();
+        for (size_t k = 0; k < pattern.size(); k += 2)
+        {
+            const int x = cvRound(kp[0].pt.x);
+            const int y = cvRound(kp[0].pt.y);
+            const int a = boxSum(x + cvRound(pattern[k].x), y + cvRound(pattern[k].y));
+            const int b = boxSum(x + cvRound(pattern[k + 1].x), y + cvRound(pattern[k + 1].y));
+            const int bit = (desc.at<uint8_t>(0, int(k / 16)) >> (7 - int(k / 2) % 8)) & 1;
+            REQUIRE(bit == int(a < b));
+        }
+    }
+
+    SECTION("image is not blurred")
+    {
+        fast->setBlurSize(0);
+        cv::Mat unblurred;
+        fast->compute(image, kp, unblurred);
+        REQUIRE(cv::norm(desc, unblurred, cv::NORM_INF) == 0);
+    }
+
+    SECTION("upper levels are not blurred")
+    {
+        // level 1 of twice upscaled image is the image itself, so keypoints get the same descriptors on both octaves
+        cv::Mat upscaled;
+        cv::resize(image, upscaled, cv::Size(), 2, 2, cv::INTER_NEAREST);
+        fast->setLevels(2);
+        fast->setScaleFactor(2);
+        std::vector<cv::KeyPoint> kp_upper = kp;
+        for (auto& p : kp_upper)
+        {
+            p.pt = p.pt * 2.f;
+            p.octave = 1;
+        }
+        cv::Mat desc_upper;
+        fast->compute(upscaled, kp_upper, desc_upper);
+        REQUIRE(cv::norm(desc, desc_upper, cv::NORM_INF) == 0);
+    }
+}
+
+TEST_CASE("sampling pattern", "[corner_detector_fast]")
+{
+    auto fast = corner_detector_fast::create();
+    const std::vector<cv::Point2f> pattern = fast->getPattern();
+    REQUIRE(pattern.size() == 512);
+    REQUIRE(corner_detector_fast::create()->getPattern() == pattern);
+
+    SECTION("seed reproduces pattern")
+    {
+        fast->setPatternSeed(corner_detector_fast::_defaultPatternSeed);
+        REQUIRE(fast->getPattern() == pattern);
+        fast->setPatternSeed(7);
+        REQUIRE(fast->getPattern() != pattern);
+        REQUIRE(fast->getPattern().size() == 512);
+    }
+
+    SECTION("pairs have distinct points")
+    {
+        // equal points of pair would give constant bit
+        for (size_t k = 0; k < pattern.size(); k += 2)
+            REQUIRE(pattern[k] != pattern[k + 1]);
+    }
+
+    SECTION("points are inside of neighbourhood")
+    {
+        int central = 0;
+        for (const auto& p : pattern)
+        {
+            REQUIRE(std::abs(p.x) <= 12);
+            REQUIRE(std::abs(p.y) <= 12);
+            central += std::abs(p.x) <= 5 && std::abs(p.y) <= 5;
+        }
+        // gaussian with standard deviation 5 keeps about half of points within it
+        REQUIRE(central > 200);
+    }
+
+    SECTION("keypoints near the border replicate it")
+    {
+        fast->setBlurSize(0);
+        cv::Mat image(40, 40, CV_8UC1);
+        cv::RNG rng(17);
+        rng.fill(image, cv::RNG::UNIFORM, 0, 256);
+        cv::Mat padded;
+        cv::copyMakeBorder(image, padded, 20, 20, 20, 20, cv::BORDER_REPLICATE);
+
+        std::vector<cv::KeyPoint> kp = {cv::KeyPoint(cv::Point2f(2, 3), 6.f), cv::KeyPoint(cv::Point2f(38, 20), 6.f)};
+        std::vector<cv::KeyPoint> kp_padded = {cv::KeyPoint(cv::Point2f(22, 23), 6.f), cv::KeyPoint(cv::Point2f(58, 40), 6.f)};
+        cv::Mat desc, desc_padded;
+        fast->compute(image, kp, desc);
+        fast->compute(padded, kp_padded, desc_padded);
+        REQUIRE(cv::norm(desc, desc_padded, cv::NORM_INF) == 0);
+    }
+
+    SECTION("pattern outside of neighbourhood is rejected")
+    {
+        std::vector<cv::Point2f> wide = pattern;
+        wide[0] = cv::Point2f(13, 0);
+        REQUIRE_THROWS(fast->setPattern(wide));
+        REQUIRE_THROWS(fast->setPattern(std::vector<cv::Point2f>(10)));
+    }
+}
+
+TEST_CASE("parameters", "[corner_detector_fast]")
+{
+    auto fast = corner_detector_fast::create(20, 12, 3);
+    REQUIRE(fast->getThreshold() == 20);
+    REQUIRE(fast->getArcLength() == 12);
+    REQUIRE(fast->getBlurSize() == 3);
+    REQUIRE_THROWS(fast->setArcLength(17));
+    REQUIRE_THROWS(fast->setBlurSize(4));
+
+    SECTION("write and read")
+    {
+        fast->setNonmaxSuppression(false);
+        fast->setMaxKeypoints(100, 2, 3);
+        fast->setBoxSampling(true);
+        fast->setPatternSeed(7);
+        cv::FileStorage out(".yml", cv::FileStorage::WRITE | cv::FileStorage::MEMORY);
+        fast->write(out);
+        const auto data = out.releaseAndGetString();
+
+        auto other = corner_detector_fast::create();
+        cv::FileStorage in(data, cv::FileStorage::READ | cv::FileStorage::MEMORY);
+        other->read(in.root());
+        REQUIRE(other->getThreshold() == 20);
+        REQUIRE(other->getArcLength() == 12);
+        REQUIRE(other->getBlurSize() == 3);
+        REQUIRE(!other->getNonmaxSuppression());
+        REQUIRE(other->getMaxKeypoints() == 100);
+        REQUIRE(other->getBoxSampling());
+        REQUIRE(other->getPattern() == fast->getPattern());
+    }
+}
@@ -0,0 +1,384 @@
+/* Descriptor matcher algorithm testing.
+ * @file
+ * @date 2018-11-25
+ * @author Anonymous
+ */
+
+#include <catch2/catch.hpp>
+
+#include <algorithm>
+#include <cfloat>
+
+#include "cvlib.hpp"
+
+using namespace cvlib;
+
+TEST_CASE("hamming distance", "[descriptor_matcher]")
+{
+    cv::Mat desc(2, 37, CV_8U);
+    cv::RNG rng(3);
+    rng.fill(desc, cv::RNG::UNIFORM, 0, 256);
+
+    SECTION("same descriptors")
+    {
+        REQUIRE(0 == descriptor_matcher::distance(desc.ptr<uint8_t>(0), desc.ptr<uint8_t>(0), desc.cols));
+    }
+
+    SECTION("matches cv::NORM_HAMMING")
+    {
+        for (int bytes : {1, 8, 32, 37})
+        {
+            const int expected = static_cast<int>(cv::norm(desc.row(0).colRange(0, bytes), desc.row(1).colRange(0, bytes), cv::NORM_HAMMING));
+            REQUIRE(expected == descriptor_matcher::distance(desc.ptr<uint8_t>(0), desc.ptr<uint8_t>(1), bytes));
+        }
+    }
+
+    SECTION("early exit keeps distances below bound")
+    {
+        const int full = descriptor_matcher::distance(desc.ptr<uint8_t>(0), desc.ptr<uint8_t>(1), desc.cols);
+        for (int bound : {1, full / 2, full, full + 1})
+        {
+            const int dist = descriptor_matcher::distance(desc.ptr<uint8_t>(0), desc.ptr<uint8_t>(1), desc.cols, bound);
+            if (full < bound)
+                REQUIRE(dist == full);
+            else
+                REQUIRE(dist >= bound);
+        }
+    }
+}
+
+TEST_CASE("brute force matching", "[descriptor_matcher]")
+{
+    // several query and train blocks with partial last ones
+    cv::Mat train(600, 32, CV_8U);
+    cv::Mat query(70, 32, CV_8U);
+    cv::RNG rng(5);
+    rng.fill(train, cv::RNG::UNIFORM, 0, 256);
+    rng.fill(query, cv::RNG::UNIFORM, 0, 256);
+
+    SECTION("k nearest")
+    {
+        descriptor_matcher matcher(1.f);
+        matcher.add(train);
+        std::vector<std::vector<cv::DMatch>> matches;
+        matcher.knnMatch(query, matches, 5);
+        REQUIRE(matches.size() == 70);
+
+        for (int i = 0; i < query.rows; ++i)
+        {
+            std::vector<std::pair<int, int>> expected;
+            for (int j = 0; j < train.rows; ++j)
+                expected.emplace_back(descriptor_matcher::distance(query.ptr<uint8_t>(i), train.ptr<uint8_t>(j), query.cols), j);
+            std::sort(expected.begin(), expected.end());
+
+            REQUIRE(matches[i].size() == 5);
+            for (int n = 0; n < 5; ++n)
+            {
+                REQUIRE(matches[i][n].queryIdx == i);
+                REQUIRE(matches[i][n].trainIdx == expected[n].second);
+                REQUIRE(matches[i][n].distance == expected[n].first);
+            }
+        }
+    }
+
+    SECTION("radius")
+    {
+        descriptor_matcher matcher;
+        matcher.add(train);
+        std::vector<std::vector<cv::DMatch>> matches;
+        matcher.radiusMatch(query, matches, 112.5f);
+        REQUIRE(matches.size() == 70);
+
+        size_t total = 0;
+        for (int i = 0; i < query.rows; ++i)
+        {
+            std::vector<std::pair<int, int>> expected;
+            for (int j = 0; j < train.rows; ++j)
+            {
+                const int d = descriptor_matcher::distance(query.ptr<uint8_t>(i), train.ptr<uint8_t>(j), query.cols);
+                if (d <= 112)
+                    expected.emplace_back(d, j);
+            }
+            std::sort(expected.begin(), expected.end());
+
+            REQUIRE(matches[i].size() == expected.size());
+            for (size_t n = 0; n < expected.size(); ++n)
+            {
+                REQUIRE(matches[i][n].trainIdx == expected[n].second);
+                REQUIRE(matches[i][n].distance == expected[n].first);
+            }
+            total += expected.size();
+        }
+        REQUIRE(total > 0);
+    }
+
+    SECTION("unbounded radius")
+    {
+        descriptor_matcher matcher;
+        matcher.add(train);
+        std::vector<std::vector<cv::DMatch>> matches;
+        matcher.radiusMatch(query.rowRange(0, 2), matches, FLT_MAX);
+        REQUIRE(matches.size() == 2);
+        REQUIRE(matches[0].size() == 600);
+        REQUIRE(matches[1].size() == 600);
+        REQUIRE_THROWS(matcher.radiusMatch(query, matches, -1.f));
+    }
+
+    SECTION("parallel matching matches serial")
+    {
+        descriptor_matcher matcher(1.f);
+        matcher.add(train);
+        std::vector<std::vector<cv::DMatch>> knn_parallel, radius_parallel;
+        matcher.knnMatch(query, knn_parallel, 3);
+        matcher.radiusMatch(query, radius_parallel, 115.f);
+
+        const int threads = cv::getNumThreads();
+        cv::setNumThreads(1);
+        std::vector<std::vector<cv::DMatch>> knn_serial, radius_serial;
+        matcher.knnMatch(query, knn_serial, 3);
+        matcher.radiusMatch(query, radius_serial, 115.f);
+        cv::setNumThreads(threads);
+
+        for (auto results : {std::make_pair(&knn_parallel, &knn_serial), std::make_pair(&radius_parallel, &radius_serial)})
+        {
+            REQUIRE(results.first->size() == results.second->size());
+            for (size_t i = 0; i < results.first->size(); ++i)
+            {
+                const auto& a = (*results.first)[i];
+                const auto& b = (*results.second)[i];
+                REQUIRE(a.size() == b.size());
+                for (size_t n = 0; n < a.size(); ++n)
+                {
+                    REQUIRE(a[n].trainIdx == b[n].trainIdx);
+                    REQUIRE(a[n].distance == b[n].distance);
+                }
+            }
+        }
+    }
+
+    SECTION("several train images")
+    {
+        descriptor_matcher single(1.f);
+        single.add(train);
+        descriptor_matcher split(1.f);
+        split.add(std::vector<cv::Mat>{train.rowRange(0, 200), cv::Mat(), train.rowRange(200, 450)});
+        split.add(train.rowRange(450, 600));
+        const int starts[] = {0, 200, 200, 450};
+
+        std::vector<std::vector<cv::DMatch>> expected, matches;
+        single.knnMatch(query, expected, 3);
+        split.knnMatch(query, matches, 3);
+        REQUIRE(matches.size() == expected.size());
+        for (size_t i = 0; i < matches.size(); ++i)
+        {
+            REQUIRE(matches[i].size() == expected[i].size());
+            for (size_t n = 0; n < matches[i].size(); ++n)
+            {
+                REQUIRE(matches[i][n].imgIdx != 1);
+                REQUIRE(starts[matches[i][n].imgIdx] + matches[i][n].trainIdx == expected[i][n].trainIdx);
+                REQUIRE(matches[i][n].distance == expected[i][n].distance);
+            }
+        }
+
+        split.radiusMatch(query, matches, 112.f);
+        for (const auto& query_matches : matches)
+            for (const auto& m : query_matches)
+                REQUIRE(m.trainIdx < split.getTrainDescriptors()[m.imgIdx].rows);
+    }
+
+    SECTION("masks")
+    {
+        descriptor_matcher matcher(1.f);
+        matcher.add(std::vector<cv::Mat>{train.rowRange(0, 300), train.rowRange(300, 600)});
+
+        // every third row of the first image is masked out for all queries, the second image is masked per query
+        std::vector<cv::Mat> masks = {cv::Mat(query.rows, 300, CV_8U, cv::Scalar(1)), cv::Mat(query.rows, 300, CV_8U)};
+        for (int j = 0; j < 300; j += 3)
+            masks[0].col(j).setTo(0);
+        rng.fill(masks[1], cv::RNG::UNIFORM, 0, 2);
+        masks[0].row(5).setTo(0);
+        masks[1].row(5).setTo(0);
+
+        std::vector<std::vector<cv::DMatch>> matches;
+        matcher.knnMatch(query, matches, 2, masks);
+        REQUIRE(matches.size() == 70);
+        for (int i = 0; i < query.rows; ++i)
+        {
+            std::vector<std::pair<int, int>> expected;
+            for (int j = 0; j < train.rows; ++j)
+            {
+                if (masks[j / 300].at<uint8_t>(i, j % 300))
+                    expected.emplace_back(descriptor_matcher::distance(query.ptr<uint8_t>(i), train.ptr<uint8_t>(j), query.cols), j);
+            }
+            std::sort(expected.begin(), expected.end());
+
+            REQUIRE(matches[i].size() == std::min<size_t>(2, expected.size()));
+            for (size_t n = 0; n < matches[i].size(); ++n)
+            {
+                REQUIRE(matches[i][n].imgIdx * 300 + matches[i][n].trainIdx == expected[n].second);
+                REQUIRE(matches[i][n].distance == expected[n].first);
+            }
+        }
+
+        matcher.radiusMatch(query, matches, 112.f, masks, true);
+        REQUIRE(matches.size() < 70);
+        for (const auto& query_matches : matches)
+        {
+            REQUIRE(!query_matches.empty());
+            for (const auto& m : query_matches)
+                REQUIRE(masks[m.imgIdx].at<uint8_t>(m.queryIdx, m.trainIdx) != 0);
+        }
+    }
+
+    SECTION("masks allowing every row")
+    {
+        descriptor_matcher matcher(1.f);
+        matcher.add(std::vector<cv::Mat>{train.rowRange(0, 300), train.rowRange(300, 600)});
+        std::vector<cv::Mat> masks = {cv::Mat(query.rows, 300, CV_8U, cv::Scalar(1)), cv::Mat()};
+
+        std::vector<std::vector<cv::DMatch>> masked, unmasked;
+        matcher.knnMatch(query, masked, 2, masks);
+        matcher.knnMatch(query, unmasked, 2);
+        REQUIRE(masked.size() == unmasked.size());
+        for (size_t i = 0; i < masked.size(); ++i)
+        {
+            REQUIRE(masked[i].size() == unmasked[i].size());
+            for (size_t n = 0; n < masked[i].size(); ++n)
+            {
+                REQUIRE(masked[i][n].imgIdx == unmasked[i][n].imgIdx);
+                REQUIRE(masked[i][n].trainIdx == unmasked[i][n].trainIdx);
+                REQUIRE(masked[i][n].distance == unmasked[i][n].distance);
+            }
+        }
+    }
+
+    SECTION("multi-index hashing")
+    {
+        // first half of queries are noisy copies of train rows
+        for (int i = 0; i < query.rows / 2; ++i)
+        {
+            train.row(i * 7).copyTo(query.row(i));
+            query.at<uint8_t>(i, (i * 5) % 32) ^= 0x81;
+            query.at<uint8_t>(i, (i * 3) % 32) ^= 0x10;
+        }
+
+        descriptor_matcher exact(1.f);
+        exact.add(train);
+        descriptor_matcher approximate(1.f);
+        approximate.set_index(0);
+        approximate.add(train);
+        REQUIRE(approximate.get_index() == 0);
+
+        std::vector<std::vector<cv::DMatch>> expected, matches;
+        exact.knnMatch(query, expected, 1);
+        approximate.knnMatch(query, matches, 1);
+        for (int i = 0; i < query.rows / 2; ++i)
+        {
+            REQUIRE(matches[i].size() == 1);
+            REQUIRE(matches[i][0].trainIdx == i * 7);
+            REQUIRE(matches[i][0].trainIdx == expected[i][0].trainIdx);
+        }
+
+        // 16 substrings probed with radius 0 find every neighbour closer than 16
+        exact.radiusMatch(query, expected, 16.f);
+        approximate.radiusMatch(query, matches, 16.f);
+        for (int i = 0; i < query.rows; ++i)
+        {
+            REQUIRE(matches[i].size() == expected[i].size());
+            for (size_t n = 0; n < matches[i].size(); ++n)
+                REQUIRE(matches[i][n].trainIdx == expected[i][n].trainIdx);
+        }
+
+        // larger probe radius finds at least the same neighbours
+        approximate.set_index(1);
+        std::vector<std::vector<cv::DMatch>> wider;
+        approximate.radiusMatch(query, wider, 100.f);
+        approximate.set_index(0);
+        approximate.radiusMatch(query, matches, 100.f);
+        for (int i = 0; i < query.rows; ++i)
+            REQUIRE(wider[i].size() >= matches[i].size());
+    }
+
+    SECTION("ratio test")
+    {
+        // first half of queries are noisy copies of train rows, second half are unrelated
+        for (int i = 0; i < query.rows / 2; ++i)
+        {
+            train.row(i * 3).copyTo(query.row(i));
+            query.at<uint8_t>(i, i % 32) ^= 0x15;
+        }
+
+        descriptor_matcher matcher(1.5f);
+        matcher.add(train);
+        std::vector<std::vector<cv::DMatch>> matches;
+        matcher.knnMatch(query, matches, 1);
+        REQUIRE(matches.size() == 70);
+        for (int i = 0; i < query.rows; ++i)
+        {
+            if (i < query.rows / 2)
+            {
+                REQUIRE(matches[i].size() == 1);
+                REQUIRE(matches[i][0].trainIdx == i * 3);
+                REQUIRE(matches[i][0].distance == 3);
+            }
+            else
+            {
+                REQUIRE(matches[i].empty());
+            }
+        }
+    }
+
+    SECTION("duplicate train rows")
+    {
+        // exact copy of query in two train rows is ambiguous, both distances are zero
+        train.row(0).copyTo(query.row(0));
+        train.row(0).copyTo(train.row(1));
+
+        descriptor_matcher matcher(1.5f);
+        matcher.add(train);
+        std::vector<std::vector<cv::DMatch>> matches;
+        matcher.knnMatch(query.row(0), matches, 1);
+        REQUIRE(matches.size() == 1);
+        REQUIRE(matches[0].empty());
+
+        // disabled ratio test returns the earlier duplicate
+        matcher.set_ratio(1.f);
+        matcher.knnMatch(query.row(0), matches, 2);
+        REQUIRE(matches[0].size() == 2);
+        REQUIRE(matches[0][0].trainIdx == 0);
+        REQUIRE(matches[0][1].trainIdx == 1);
+        REQUIRE(matches[0][1].distance == 0);
+    }
+}
+
+TEST_CASE("multi-index hashing ratio test", "[descriptor_matcher]")
+{
+    // first train row differs from query in one bit of 12 substrings, the second one in one bit of every substring
+    cv::Mat query(1, 32, CV_8U, cv::Scalar(0));
+    cv::Mat train(2, 32, CV_8U, cv::Scalar(0));
+    for (int s = 0; s < 16; ++s)
+    {
+        if (s < 12)
+            train.at<uint8_t>(0, 2 * s) = 1;
+        train.at<uint8_t>(1, 2 * s) = 1;
+    }
+
+    descriptor_matcher exact(1.5f);
+    exact.add(train);
+    descriptor_matcher approximate(1.5f);
+    approximate.set_index(0);
+    approximate.add(train);
+
+    // 16 / 12 is below the ratio, the index misses the second row and must not take the query as unambiguous
+    std::vector<std::vector<cv::DMatch>> matches;
+    exact.knnMatch(query, matches, 1);
+    REQUIRE(matches[0].empty());
+    approximate.knnMatch(query, matches, 1);
+    REQUIRE(matches[0].empty());
+
+    // rows at distance (probe_radius + 1) * substrings are not guaranteed to be found
+    approximate.radiusMatch(query, matches, 17.f);
+    REQUIRE(matches[0].size() == 1);
+    REQUIRE(matches[0][0].trainIdx == 0);
+    REQUIRE(matches[0][0].distance == 12);
+}
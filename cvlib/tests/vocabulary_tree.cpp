@@ -0,0 +1,114 @@
+/* Vocabulary tree testing.
+ * @file
+ * @date 2018-11-25
+ * @author Anonymous
+ */
+
+#include <catch2/catch.hpp>
+
+#include <cmath>
+
+#include "cvlib.hpp"
+
+using namespace cvlib;
+
+TEST_CASE("vocabulary tree", "[vocabulary_tree]")
+{
+    std::vector<cv::Mat> images(5);
+    cv::RNG rng(23);
+    for (auto& desc : images)
+    {
+        desc.create(200, 32, CV_8U);
+        rng.fill(desc, cv::RNG::UNIFORM, 0, 256);
+    }
+
+    vocabulary_tree tree(8, 3);
+    tree.build(images);
+    REQUIRE(tree.words() > 64);
+    REQUIRE(tree.words() <= 512);
+
+    SECTION("every descriptor has a word")
+    {
+        for (const auto& desc : images)
+        {
+            for (int i = 0; i < desc.rows; ++i)
+            {
+                const int word = tree.quantize(desc.ptr<uint8_t>(i));
+                REQUIRE(word >= 0);
+                REQUIRE(word < tree.words());
+            }
+        }
+    }
+
+    SECTION("query finds image")
+    {
+        for (const auto& desc : images)
+            tree.add(desc);
+
+        auto results = tree.query(images[2], 3);
+        REQUIRE(!results.empty());
+        REQUIRE(results.size() <= 3);
+        REQUIRE(results[0].first == 2);
+        REQUIRE(results[0].second == Approx(1.f));
+
+        results = tree.query(images[4].rowRange(0, 100), 5);
+        REQUIRE(results[0].first == 4);
+        for (size_t n = 1; n < results.size(); ++n)
+            REQUIRE(results[n].second <= results[n - 1].second);
+
+        tree.clear();
+        REQUIRE(tree.query(images[2], 3).empty());
+    }
+
+    SECTION("build does not depend on threads")
+    {
+        const int threads = cv::getNumThreads();
+        cv::setNumThreads(1);
+        vocabulary_tree serial(8, 3);
+        serial.build(images);
+        cv::setNumThreads(threads);
+
+        REQUIRE(serial.words() == tree.words());
+        for (int i = 0; i < images[0].rows; ++i)
+            REQUIRE(serial.quantize(images[0].ptr<uint8_t>(i)) == tree.quantize(images[0].ptr<uint8_t>(i)));
+    }
+}
+
+TEST_CASE("vocabulary tree scores", "[vocabulary_tree]")
+{
+    // two distinct descriptors give two words, A appears in 3 of 4 training images and B in 2 of them
+    const cv::Mat a(1, 4, CV_8U, cv::Scalar(0));
+    const cv::Mat b(1, 4, CV_8U, cv::Scalar(255));
+    cv::Mat ab, aab;
+    cv::vconcat(std::vector<cv::Mat>{a, b}, ab);
+    cv::vconcat(std::vector<cv::Mat>{a, a, b}, aab);
+
+    vocabulary_tree tree(2, 1);
+    tree.build({a, a, b, ab});
+    REQUIRE(tree.words() == 2);
+    REQUIRE(tree.quantize(a.ptr<uint8_t>()) != tree.quantize(b.ptr<uint8_t>()));
+
+    REQUIRE(tree.add(aab) == 0);
+    REQUIRE(tree.add(b) == 1);
+
+    // L1-normalized TF-IDF vectors and score 1 - |q - d| / 2
+    const double idf_a = std::log(4. / 3.);
+    const double idf_b = std::log(2.);
+    const double q_a = idf_a / (idf_a + idf_b);
+    const double q_b = idf_b / (idf_a + idf_b);
+    const double d_a = 2 * idf_a / (2 * idf_a + idf_b);
+    const double d_b = idf_b / (2 * idf_a + idf_b);
+    const double score0 = 1 - 0.5 * (std::abs(q_a - d_a) + std::abs(q_b - d_b));
+    const double score1 = 1 - 0.5 * (q_a + std::abs(q_b - 1));
+
+    const auto results = tree.query(ab, 2);
+    REQUIRE(results.size() == 2);
+    REQUIRE(results[0].first == 0);
+    REQUIRE(results[0].second == Approx(score0));
+    REQUIRE(results[1].first == 1);
+    REQUIRE(results[1].second == Approx(score1));
+
+    REQUIRE(tree.query(ab, 1).size() == 1);
+    REQUIRE(tree.query(ab, 0).empty());
+    REQUIRE_THROWS(tree.query(ab, -1));
+}
@@ -22,9 +22,9 @@ int demo_feature_matching(int argc, char* argv[])
     cv::namedWindow(demo_wnd);
 
 
-    int r = 50;
+    int r = 150; // ratio in percents
     auto detector = cvlib::corner_detector_fast::create(); // \todo use your detector from cvlib
-    auto matcher = cvlib::descriptor_matcher(r); //\todo add trackbar to demo_wnd to tune ratio value
+    auto matcher = cvlib::descriptor_matcher(r / 100.f);
 
     /// \brief helper struct for tidy code
     struct img_features
@@ -42,7 +42,7 @@ int demo_feature_matching(int argc, char* argv[])
     cv::Mat demo_frame;
     utils::fps_counter fps;
     int pressed_key = 0;
-    cv::createTrackbar("r", demo_wnd, &r, 255);
+    cv::createTrackbar("r", demo_wnd, &r, 300);
     while (pressed_key != 27) // ESC
     {
         cap >> test.img;
@@ -65,8 +65,8 @@ int demo_feature_matching(int argc, char* argv[])
 
         detector->compute(test.img, test.corners, test.descriptors);
         //\todo add trackbar to demo_wnd to tune threshold value
-        matcher.set_ratio(r);
-        matcher.radiusMatch(test.descriptors, ref.descriptors, pairs, 100.0f);
+        matcher.set_ratio(r / 100.f);
+        matcher.knnMatch(test.descriptors, ref.descriptors, pairs, 1);
         cv::drawMatches(test.img, test.corners, ref.img, ref.corners, pairs, demo_frame);
 
         utils::put_fps_text(demo_frame, fps);